@@ -6,16 +6,40 @@
  * directory and its subdirectories. It provides options for customizing the
  * file size analysis, including the number of files to list, the depth of
  * subdirectories to consider, and the ability to display only file paths
- * without sizes.
+ * without sizes. The scanning itself is done by the scanner library in
+ * scanner.hpp and scanner.cpp.
  *
  * @note Usage:
- *     largest -n num -d num -b filemask
+ *     largest -n num -d num -j num -m num -b filemask...
+ *     largest merge -n num -b -r file...
  *
  * @note Options:
  *   -n num    : Number of largest files to list (default: 50, use -1 to list all files)
  *   -d num    : Depth of subdirectories to consider (default: -1, infinite depth)
+ *   -j num    : Number of threads scanning directories (default: 0, one per CPU core; auto: tune while scanning)
+ *   -m num    : Memory budget in MB, beyond it files are sorted on disk (default: 0, no limit)
+ *   --numa    : Pin the scanning threads to CPUs spread over the NUMA nodes, each node with its own queue (Linux only)
+ *   --inode-order num : Stat files in inode order, num directories at a time (default: 0, off)
+ *   --max-stats num : Maximum number of stat calls per second (default: 0, no limit)
+ *   --max-dirs num  : Maximum number of directories read per second (default: 0, no limit)
+ *   --adaptive      : Slow down while stat latency is rising
+ *   --time-limit num : Stop scanning after num seconds and list the largest files found so far
+ *   --estimate num : Estimate total size, file count and size distribution from num random probes
+ *   --checkpoint file : Save the progress of the scan to file every minute
+ *   --resume file : Continue an interrupted scan from its checkpoint file
+ *   --watch num : Keep watching for changes, reprinting the list at most every num seconds (Linux only)
+ *   --grow num  : Keep listing the fastest growing files, measured every num seconds
+ *   --shard i/N : Scan only the i-th of N parts of the tree, counting from 0
+ *   --save file : Save the listing and totals to file for "largest merge" instead of printing it
+ *   --archives  : List the largest files inside zip and tar archives instead
+ *   --extents   : Report extents, fragments and shared bytes of the files listed (Linux only)
+ *   --compressibility : Estimate how much compressing the files listed would save
+ *   --type      : Show the content type of the files listed, told by their first bytes
+ *   --only types : List only files of these content types, separated by commas
+ *   --regex expr : List only files whose relative path matches the regular expression
+ *   -L        : Follow symbolic links to directories, scanning every directory once
  *   -b        : Display only file paths without file sizes
- *   filemask  : File mask to filter files (default: *)
+ *   filemask  : File masks to filter files, a file matching any of them is listed (default: *)
  */
 
 #include <iostream>
@@ -24,15 +48,50 @@
 #include <algorithm>
 #include <iomanip> // for std::setw
 #include <sstream>
+#include <string_view>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <array>
+#include <cmath>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <ctime>
+#include <limits>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
 
-namespace fs = std::filesystem;
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-/**
- * @brief Comparator function to sort files by size in descending order.
- */
-bool sortBySize(const fs::directory_entry& a, const fs::directory_entry& b) {
-    return fs::file_size(a) > fs::file_size(b);
-}
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
+
+// Compressed tar archives are only read if built with -DLARGEST_ZLIB and linked with -lz
+#ifdef LARGEST_ZLIB
+#include <zlib.h>
+#endif
+
+#include "scanner_internal.hpp"
+
+using namespace largest;
 
 /**
  * @brief Format file size with thousands separators and right-align the numbers.
@@ -59,99 +118,1726 @@ std::string formatFileSize(uintmax_t size) {
     return oss.str();
 }
 
+/**
+ * @brief Prints a listed file, with its size unless bare, and relative to the scan root if asked.
+ */
+class FilePrinter {
+public:
+    FilePrinter(const fs::path& root, const ToolOptions& options)
+        : rootLength(rootPrefixLength(root)), options(options) {}
+
+    /**
+     * @brief Print a file, with optional details following its size.
+     */
+    void operator()(uintmax_t size, const std::string& filePath, std::string_view details = {}) const {
+        std::string_view displayPath = filePath;
+        if (options.relative) {
+            displayPath.remove_prefix(rootLength);
+        }
+
+        if (options.bare) {
+            std::cout << displayPath << "\n";
+        } else {
+            std::cout << formatFileSize(size) << " " << details << displayPath << "\n";
+        }
+    }
+
+private:
+    std::size_t rootLength;
+    const ToolOptions& options;
+};
+
+#ifdef __linux__
+/**
+ * @brief Physical layout of a file.
+ */
+struct FileExtents {
+    bool known = false;      ///< The file system reported the extents
+    uint64_t extents = 0;
+    uint64_t fragments = 0;  ///< Runs of extents that are contiguous on disk
+    uintmax_t sharedBytes = 0; ///< Bytes in extents shared with other files, e.g. reflinked copies or snapshots
+};
+
+/**
+ * @brief Query the extents of a file with the FIEMAP ioctl.
+ *
+ * Extents that continue each other on disk count as one fragment, so a file
+ * in a single fragment is not fragmented, however many extents the file
+ * system splits it into. Like filefrag, an extent following a hole still
+ * continues the previous one if it lies where the hole would have ended.
+ */
+FileExtents queryExtents(const std::string& path) {
+    FileExtents result;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return result;
+    }
+
+    const unsigned batch = 256;
+    std::vector<char> buffer(sizeof(fiemap) + batch * sizeof(fiemap_extent));
+    fiemap* map = reinterpret_cast<fiemap*>(buffer.data());
+    uint64_t start = 0;
+    uint64_t logicalEnd = 0;
+    uint64_t physicalEnd = 0;
+    bool last = false;
+    while (!last) {
+        std::fill(buffer.begin(), buffer.end(), 0);
+        map->fm_start = start;
+        map->fm_length = FIEMAP_MAX_OFFSET - start;
+        map->fm_extent_count = batch;
+        if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+            close(fd);
+            return result;
+        }
+        if (map->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (unsigned i = 0; i < map->fm_mapped_extents; ++i) {
+            const fiemap_extent& extent = map->fm_extents[i];
+            result.extents++;
+            if (result.extents == 1 || extent.fe_physical != physicalEnd + (extent.fe_logical - logicalEnd)) {
+                result.fragments++;
+            }
+            logicalEnd = extent.fe_logical + extent.fe_length;
+            physicalEnd = extent.fe_physical + extent.fe_length;
+            if (extent.fe_flags & FIEMAP_EXTENT_SHARED) {
+                result.sharedBytes += extent.fe_length;
+            }
+            last = extent.fe_flags & FIEMAP_EXTENT_LAST;
+        }
+        const fiemap_extent& final = map->fm_extents[map->fm_mapped_extents - 1];
+        start = final.fe_logical + final.fe_length;
+    }
+    close(fd);
+    result.known = true;
+    return result;
+}
+#endif
+
+#ifdef __linux__
+/**
+ * @brief Describe the extents of a file for the listing.
+ */
+std::string describeExtents(const std::string& path) {
+    FileExtents extents = queryExtents(path);
+    if (!extents.known) {
+        return "extents unknown ";
+    }
+    std::ostringstream details;
+    details << std::setw(6) << extents.extents << " extents " << std::setw(6) << extents.fragments << " fragments "
+            << formatFileSize(extents.sharedBytes) << " shared ";
+    return details.str();
+}
+#endif
+
+/**
+ * @brief Estimate how small a block would compress.
+ *
+ * The block is run through the match finder of a fast LZ compressor: a hash of
+ * the next 4 bytes points to their last occurrence, and a match of at least 4
+ * bytes is counted at about 3 bytes for offset and length. The bytes not covered
+ * by matches count with their order-0 entropy, as an entropy coder would store
+ * them. This tells text, logs and databases from media and already compressed
+ * files at a fraction of the cost of compressing.
+ *
+ * @return The estimated compressed size in bytes.
+ */
+double estimateCompressedSize(const unsigned char* data, std::size_t size) {
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    const double matchCost = 3;
+    std::vector<uint32_t> table(1 << 12, none);
+    std::array<std::size_t, 256> counts{};
+    std::size_t literals = 0;
+    std::size_t matches = 0;
+
+    std::size_t pos = 0;
+    while (pos + 4 <= size) {
+        uint32_t sequence;
+        std::memcpy(&sequence, data + pos, sizeof(sequence));
+        uint32_t& slot = table[(sequence * 2654435761u) >> 20];
+        uint32_t candidate = slot;
+        slot = static_cast<uint32_t>(pos);
+        if (candidate != none && std::memcmp(data + candidate, data + pos, 4) == 0) {
+            std::size_t length = 4;
+            while (pos + length < size && data[candidate + length] == data[pos + length]) {
+                length++;
+            }
+            matches++;
+            pos += length;
+            continue;
+        }
+        counts[data[pos++]]++;
+        literals++;
+    }
+    for (; pos < size; ++pos) {
+        counts[data[pos]]++;
+        literals++;
+    }
+
+    double bits = 0;
+    for (std::size_t count : counts) {
+        if (count > 0) {
+            bits -= count * std::log2(static_cast<double>(count) / literals);
+        }
+    }
+    return bits / 8 + matches * matchCost;
+}
+
+/**
+ * @brief Describe how much compressing a file would save, estimated from samples.
+ *
+ * Up to 16 blocks of 64 KB spread evenly over the file are read, so even a huge
+ * file costs at most 1 MB of reads.
+ */
+std::string describeCompressibility(uintmax_t size, const std::string& path) {
+    const std::size_t blockSize = 64 * 1024;
+    const uintmax_t samples = 16;
+    std::ifstream in(path, std::ios::binary);
+    std::vector<unsigned char> block(blockSize);
+    double sampled = 0;
+    double compressed = 0;
+
+    const uintmax_t blocks = std::min<uintmax_t>(samples, (size + blockSize - 1) / blockSize);
+    for (uintmax_t i = 0; in && i < blocks; ++i) {
+        uintmax_t offset = blocks > 1 && size > blockSize ? (size - blockSize) * i / (blocks - 1) : i * blockSize;
+        in.seekg(offset & ~uintmax_t(4095)); // Aligned reads are cheaper
+        in.read(reinterpret_cast<char*>(block.data()), block.size());
+        std::size_t length = static_cast<std::size_t>(in.gcount());
+        in.clear();
+        if (length == 0) {
+            break;
+        }
+        sampled += length;
+        compressed += estimateCompressedSize(block.data(), length);
+    }
+    if (sampled == 0) {
+        return "compressibility unknown ";
+    }
+
+    double saved = std::max(0.0, 1 - compressed / sampled);
+    std::ostringstream details;
+    details << std::setw(3) << static_cast<int>(saved * 100 + 0.5) << "% " << formatFileSize(static_cast<uintmax_t>(size * saved)) << " saved ";
+    return details.str();
+}
+
+/**
+ * @brief Print the listed files, each with the details asked for: its extents, its compressibility, its type.
+ *
+ * The details are gathered in parallel, each thread taking the next file, so
+ * this adds little to the scan even for a long listing.
+ */
+void printWithDetails(const std::vector<std::pair<uintmax_t, std::string>>& files, const FilePrinter& print, const ToolOptions& options) {
+    std::vector<std::string> details(files.size());
+    std::atomic<std::size_t> next{0};
+    auto describe = [&]() {
+        for (std::size_t i = next++; i < files.size(); i = next++) {
+#ifdef __linux__
+            if (options.extents) {
+                details[i] += describeExtents(files[i].second);
+            }
+#endif
+            if (options.compressibility) {
+                details[i] += describeCompressibility(files[i].first, files[i].second);
+            }
+            if (options.showTypes) {
+                std::ostringstream type;
+                type << std::setw(10) << std::left << fileTypeNames[static_cast<int>(classifyFiles({&files[i].second}).front())] << " ";
+                details[i] += type.str();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::min<std::size_t>(walkerCount(options), files.size()); ++i) {
+        threads.emplace_back(describe);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        print(files[i].first, files[i].second, details[i]);
+    }
+}
+
+/**
+ * @brief Tell how much of the tree a scan has covered, on the error output.
+ *
+ * Directories that could not be opened are always reported, the coverage of a
+ * time limited scan only if a time limit was given.
+ */
+void reportCoverage(const ScanTotals& totals, const ToolOptions& options) {
+    if (totals.failedDirs > 0) {
+        std::cerr << "Warning: " << totals.failedDirs << " directories could not be opened, listing is incomplete\n";
+    }
+    if (options.timeLimit <= 0) {
+        return;
+    }
+    const bool complete = totals.pendingDirs == 0 && totals.failedDirs == 0;
+    std::cerr << std::fixed << std::setprecision(1)
+              << "Scanned " << totals.dirCount << " directories in " << totals.seconds << " s, "
+              << totals.pendingDirs << " pending"
+              << (totals.pendingDirs > 0 ? " (time limit reached, listing is incomplete)" : complete ? " (scan complete)" : "") << "\n";
+}
+
+/**
+ * @brief Tell which files are of the content types asked for with --only, all of them without it.
+ *
+ * For the files a mode reads by itself after or instead of walkTree(), which
+ * keeps only the files of these types already.
+ */
+std::vector<bool> matchesTypes(const std::vector<const std::string*>& paths, const ToolOptions& options) {
+    std::vector<bool> matches(paths.size(), true);
+    if (options.typeMask != 0) {
+        std::vector<FileType> types = classifyFiles(paths);
+        for (std::size_t i = 0; i < paths.size(); ++i) {
+            matches[i] = (options.typeMask & (1u << static_cast<int>(types[i]))) != 0;
+        }
+    }
+    return matches;
+}
+
 /**
  * @brief List the largest files in the specified directory and its subdirectories.
  *
+ * With a partial result file, the listing is saved to it together with the
+ * totals of the scan, for merging with the other shards of the tree.
+ *
  * @param path The directory path to start the search.
- * @param fileMask The file mask to filter files (default is "*").
- * @param depth The maximum depth of subdirectories to consider (default is -1, indicating infinite depth).
- * @param numFiles The number of largest files to display (default is 50, use -1 to display all files).
- * @param bare Flag indicating whether to display only file paths without file sizes (default is false).
- * @param relative Flag indicating whether to display relative paths (default is false).
+ * @param options The options controlling the scan and the listing.
+ * @param resumeFrom The checkpoint to continue from, or nullptr to start a new scan.
  */
-void listLargestFiles(const fs::path& path, const std::string& fileMask = "*", int depth = -1, int numFiles = 50, bool bare = false, bool relative = false) {
-    std::vector<fs::directory_entry> files;
+void listLargestFiles(const fs::path& path, const ToolOptions& options, const Checkpoint* resumeFrom = nullptr) {
+    TopFiles top = scanTopFiles(path, options, resumeFrom);
+    reportCoverage(top.totals(), options);
+
+    std::ofstream partialOut;
+    if (!options.partialFile.empty()) {
+        PartialResult partial;
+        partial.root = path.string();
+        partial.fileMask = joinFileMasks(options.fileMasks());
+        partial.depth = options.depth;
+        partial.numFiles = options.numFiles;
+        partial.typeMask = options.typeMask;
+        partial.followLinks = options.followLinks;
+        partial.regex = options.regexSource();
+        partial.shardIndex = options.shardIndex;
+        partial.shardCount = options.shardCount;
+        partial.fileCount = top.totals().fileCount;
+        partial.totalBytes = top.totals().totalBytes;
+        partial.dirCount = top.totals().dirCount;
+        partialOut.open(options.partialFile, std::ios::binary);
+        writePartialHeader(partialOut, partial);
+    }
 
-    // Recursive directory iterator
-    for (const auto& entry : fs::recursive_directory_iterator(path)) {
-        if (fs::is_regular_file(entry) && (fileMask == "*" || entry.path().filename().string().find(fileMask) != std::string::npos)) {
-            files.push_back(entry);
+    FilePrinter print(path, options);
+    std::vector<std::pair<uintmax_t, std::string>> listed; // Files waiting for their details
+    top.emit([&](uintmax_t size, const std::string& filePath) {
+        if (partialOut.is_open()) {
+            writeRecord(partialOut, size, filePath);
+        } else if (options.extents || options.compressibility || options.showTypes) {
+            listed.emplace_back(size, filePath);
+        } else {
+            print(size, filePath);
         }
+        return true;
+    });
+
+    if (partialOut.is_open() && !partialOut.flush()) {
+        throw std::runtime_error("Failed to write partial result " + options.partialFile);
+    }
+    if (!listed.empty()) {
+        printWithDetails(listed, print, options);
     }
+}
 
-    // Sort files by size
-    std::sort(files.begin(), files.end(), sortBySize);
+/**
+ * @brief All files of a watched tree, indexed by path and ranked by size.
+ *
+ * Both indexes are balanced trees, so adding, resizing or removing a file is
+ * O(log n), the files below a directory are a contiguous range of the path
+ * index, and the top N are simply the first N entries of the ranking.
+ */
+class RankedFiles {
+public:
+    /**
+     * @brief Add a file or change its size.
+     */
+    void update(const std::string& path, uintmax_t size) {
+        auto found = sizes.find(path);
+        if (found != sizes.end()) {
+            if (found->second == size) {
+                return;
+            }
+            ranking.erase({found->second, &found->first});
+            found->second = size;
+        } else {
+            found = sizes.emplace(path, size).first;
+        }
+        ranking.insert({size, &found->first});
+    }
 
-    // Display the largest files
-    int count = 0;
-    for (const auto& entry : files) {
-        if (numFiles == -1 || count < numFiles) {
-            std::string filePath = relative ? fs::relative(entry.path(), path).string() : entry.path().string();
+    /**
+     * @brief Remove a file, if it is known.
+     */
+    void remove(const std::string& path) {
+        auto found = sizes.find(path);
+        if (found != sizes.end()) {
+            ranking.erase({found->second, &found->first});
+            sizes.erase(found);
+        }
+    }
+
+    /**
+     * @brief Remove all files below a directory.
+     */
+    void removeTree(const std::string& dir) {
+        const std::string prefix = dir + '/';
+        auto it = sizes.lower_bound(prefix);
+        while (it != sizes.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            ranking.erase({it->second, &it->first});
+            it = sizes.erase(it);
+        }
+    }
 
-            if (bare) {
-                std::cout << filePath << "\n";
+    /**
+     * @brief Get the n largest files, or all of them for n = -1.
+     */
+    std::vector<std::pair<uintmax_t, std::string>> top(int n) const {
+        std::vector<std::pair<uintmax_t, std::string>> files;
+        for (const auto& file : ranking) {
+            if (n != -1 && files.size() >= static_cast<std::size_t>(n)) {
+                break;
+            }
+            files.emplace_back(file.first, *file.second);
+        }
+        return files;
+    }
+
+private:
+    /**
+     * @brief Ranking order: descending size, then ascending path.
+     */
+    struct Larger {
+        bool operator()(const std::pair<uintmax_t, const std::string*>& a, const std::pair<uintmax_t, const std::string*>& b) const {
+            return a.first > b.first || (a.first == b.first && *a.second < *b.second);
+        }
+    };
+
+    std::map<std::string, uintmax_t> sizes;
+    std::set<std::pair<uintmax_t, const std::string*>, Larger> ranking;
+};
+
+#ifdef __linux__
+/**
+ * @brief Keeps a ranking of the files in a tree up to date from inotify events.
+ */
+class TreeWatcher {
+public:
+    TreeWatcher(const fs::path& root, const ToolOptions& options, RankedFiles& files)
+        : options(options), rootLength(rootPrefixLength(root)), files(files) {
+        fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to initialize inotify");
+        }
+    }
+
+    ~TreeWatcher() {
+        close(fd);
+    }
+
+    int descriptor() const {
+        return fd;
+    }
+
+    /**
+     * @brief Watch a directory for changes of the files directly in it.
+     */
+    void watch(const std::string& dir, int depth) {
+        const uint32_t events = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                              | IN_ONLYDIR | IN_DONT_FOLLOW;
+        int wd = inotify_add_watch(fd, dir.c_str(), events);
+        if (wd >= 0) {
+            dirs[wd] = {dir, depth};
+        } else if (errno == ENOSPC && !warned) {
+            std::cerr << "Warning: out of inotify watches, raise fs.inotify.max_user_watches to watch the whole tree" << std::endl;
+            warned = true;
+        }
+    }
+
+    /**
+     * @brief Scan and watch a directory that appeared while watching.
+     */
+    void addTree(const std::string& dir, int depth) {
+        watch(dir, depth);
+        std::error_code ec;
+        fs::directory_iterator it(fs::path(dir), fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            const fs::directory_entry& entry = *it;
+            std::error_code entryEc;
+            if (entry.is_directory(entryEc) && !entry.is_symlink(entryEc)) {
+                if (options.depth == -1 || depth < options.depth) {
+                    addTree(entry.path().string(), depth + 1);
+                }
+            } else if (matchesFilters(entry.path(), options, rootLength)) {
+                changed.insert(entry.path().string());
+            }
+        }
+    }
+
+    /**
+     * @brief Read the pending events and apply them to the ranking.
+     *
+     * Changes of a file are collected first, so a file written to many times
+     * is only stat'ed once per call. With --only, the changed files are
+     * classified again, as writing to a file may change its type.
+     *
+     * @return false if events were lost and the tree needs to be scanned again.
+     */
+    bool processEvents() {
+        alignas(struct inotify_event) char buffer[65536];
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        bool complete = true;
+
+        for (char* next = buffer; length > 0 && next < buffer + length;) {
+            const auto* event = reinterpret_cast<const struct inotify_event*>(next);
+            next += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                complete = false;
+                continue;
+            }
+            auto dir = dirs.find(event->wd);
+            if (dir == dirs.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                dirs.erase(dir);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            const std::string path = dir->second.first + (dir->second.first.back() == '/' ? "" : "/") + event->name;
+            const int depth = dir->second.second;
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    removeTree(path);
+                } else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (options.depth == -1 || depth < options.depth)) {
+                    addTree(path, depth + 1);
+                }
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                files.remove(path);
+                changed.erase(path);
+            } else if (matchesFilters(fs::path(path), options, rootLength)) {
+                changed.insert(path);
+            }
+        }
+
+        std::vector<const std::string*> paths;
+        for (const auto& path : changed) {
+            paths.push_back(&path);
+        }
+        std::vector<bool> listed = matchesTypes(paths, options);
+        for (std::size_t i = 0; i < paths.size(); ++i) {
+            struct stat info;
+            if (listed[i] && stat(paths[i]->c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+                files.update(*paths[i], info.st_size);
             } else {
-                std::cout << formatFileSize(fs::file_size(entry)) << " " << filePath << "\n";
+                files.remove(*paths[i]);
             }
-            count++;
-        } else {
+        }
+        changed.clear();
+        return complete;
+    }
+
+private:
+    /**
+     * @brief Forget a directory that is gone, with all its files and watched subdirectories.
+     */
+    void removeTree(const std::string& dir) {
+        files.removeTree(dir);
+        const std::string prefix = dir + '/';
+        for (auto it = dirs.begin(); it != dirs.end();) {
+            if (it->second.first == dir || it->second.first.compare(0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(fd, it->first);
+                it = dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    const ToolOptions& options;
+    std::size_t rootLength; ///< Length of the scan root and its separator
+    RankedFiles& files;
+    int fd;
+    bool warned = false;
+    std::unordered_map<int, std::pair<std::string, int>> dirs;
+    std::set<std::string> changed;
+};
+#endif
+
+/**
+ * @brief List the largest files, then keep the listing up to date as files change.
+ *
+ * Every directory is watched with inotify as soon as the initial scan reaches
+ * it, and every change is applied to an index of all files ranked by size. Whenever the top
+ * N have changed, they are printed again, at most once per watch interval.
+ *
+ * @param path The directory path to watch.
+ * @param options The options controlling the scan and the listing.
+ */
+void watchLargestFiles(const fs::path& path, const ToolOptions& options) {
+#ifdef __linux__
+    FilePrinter print(path, options);
+    std::vector<std::pair<uintmax_t, std::string>> shown;
+    bool first = true;
+    const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.watchInterval));
+    auto nextPrint = std::chrono::steady_clock::now();
+
+    // Any file may grow into the top N later, so the initial scan keeps all of them
+    ToolOptions scanOptions = options;
+    scanOptions.numFiles = -1;
+
+    for (;;) {
+        RankedFiles files;
+        TreeWatcher watcher(path, options, files);
+
+        // Every directory is watched before the scan reads it, so files and directories
+        // created meanwhile show up as events
+        const DirHook watchDirectory = [&watcher](const std::string& dir, int depth) { watcher.watch(dir, depth); };
+        ScanTotals totals;
+        std::vector<WalkResult> results = walkTree(path, scanOptions, nullptr, nullptr, &totals, nullptr, &watchDirectory);
+        reportCoverage(totals, options);
+        for (auto& result : results) {
+            for (const auto& file : result.files) {
+                files.update(result.paths[file.index], file.size);
+            }
+            result = WalkResult();
+        }
+
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= nextPrint) {
+                auto top = files.top(options.numFiles);
+                if (first || top != shown) {
+                    std::time_t time = std::time(nullptr);
+                    if (!first) {
+                        std::cout << "\n";
+                    }
+                    std::cout << "--- " << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << " ---\n";
+                    for (const auto& file : top) {
+                        print(file.first, file.second);
+                    }
+                    std::cout.flush();
+                    shown = std::move(top);
+                    first = false;
+                }
+                nextPrint = now + interval;
+            }
+
+            pollfd events = {watcher.descriptor(), POLLIN, 0};
+            int timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(nextPrint - now).count());
+            if (poll(&events, 1, std::max(0, timeout)) > 0 && !watcher.processEvents()) {
+                std::cerr << "Warning: inotify events lost, scanning again" << std::endl;
+                break;
+            }
+        }
+    }
+#else
+    (void)path;
+    (void)options;
+    throw std::runtime_error("--watch is only supported on Linux");
+#endif
+}
+
+/**
+ * @brief Keep listing the files growing fastest.
+ *
+ * An initial scan picks the candidates: the largest files and the files modified
+ * within the last hour. From then on only the candidates are stat'ed every
+ * interval, and their growth in bytes per second is ranked. Directories holding
+ * candidates are checked for changes as well; when one has changed, it is read
+ * again to pick up new files, such as a log file that was just rotated. Thus the
+ * cost of each round is proportional to the number of candidates, not to the
+ * size of the tree.
+ *
+ * @param path The directory path to monitor.
+ * @param options The options controlling the scan and the listing.
+ */
+void monitorGrowth(const fs::path& path, const ToolOptions& options) {
+    struct Candidate {
+        uintmax_t size;
+        double rate = 0;
+    };
+
+    // The largest files are candidates, as are all recently modified ones
+    ToolOptions scanOptions = options;
+    scanOptions.numFiles = std::max(1000, 4 * options.numFiles);
+    ScanTotals totals;
+    std::vector<WalkResult> results = walkTree(path, scanOptions, nullptr, nullptr, &totals);
+    reportCoverage(totals, options);
+
+    std::map<std::string, Candidate> candidates;
+    for (auto& result : results) {
+        for (const auto& file : result.files) {
+            candidates[result.paths[file.index]] = {file.size};
+        }
+        std::vector<const std::string*> recent;
+        for (const auto& file : result.recent) {
+            recent.push_back(&file);
+        }
+        std::vector<bool> listed = matchesTypes(recent, options);
+        for (std::size_t i = 0; i < recent.size(); ++i) {
+            std::error_code ec;
+            uintmax_t size = fs::file_size(*recent[i], ec);
+            if (listed[i] && !ec) {
+                candidates[*recent[i]] = {size};
+            }
+        }
+        result = WalkResult();
+    }
+
+    // Directories of the candidates, with the time they were last seen modified.
+    // They are read once more in the first round, catching files created during the scan.
+    std::map<std::string, fs::file_time_type> dirs;
+    for (const auto& candidate : candidates) {
+        dirs.emplace(fs::path(candidate.first).parent_path().string(), fs::file_time_type::min());
+    }
+
+    FilePrinter print(path, options);
+    const std::size_t rootLength = rootPrefixLength(path);
+    const auto interval = std::chrono::duration<double>(options.growInterval);
+    auto last = std::chrono::steady_clock::now();
+
+    for (;;) {
+        std::this_thread::sleep_until(last + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval));
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last).count();
+        last = now;
+
+        // Measure the growth of the candidates, dropping those that are gone
+        for (auto it = candidates.begin(); it != candidates.end();) {
+            std::error_code ec;
+            uintmax_t size = fs::file_size(it->first, ec);
+            if (ec) {
+                it = candidates.erase(it);
+                continue;
+            }
+            // A file truncated or rotated away does not grow
+            it->second.rate = size > it->second.size ? (size - it->second.size) / elapsed : 0;
+            it->second.size = size;
+            ++it;
+        }
+
+        // Pick up files recently created in the directories of the candidates
+        const auto recentSince = fs::file_time_type::clock::now() - recentWindow;
+        std::vector<std::pair<std::string, uintmax_t>> found;
+        for (auto& dir : dirs) {
+            std::error_code ec;
+            fs::file_time_type modified = fs::last_write_time(dir.first, ec);
+            if (ec || modified == dir.second) {
+                continue;
+            }
+            dir.second = modified;
+
+            fs::directory_iterator it(fs::path(dir.first), fs::directory_options::skip_permission_denied, ec);
+            for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+                const fs::directory_entry& entry = *it;
+                std::error_code entryEc;
+                const std::string filePath = entry.path().string();
+                if (candidates.find(filePath) == candidates.end() && entry.is_regular_file(entryEc)
+                    && matchesFilters(entry.path(), options, rootLength) && entry.last_write_time(entryEc) >= recentSince) {
+                    uintmax_t size = entry.file_size(entryEc);
+                    if (!entryEc) {
+                        found.emplace_back(filePath, size);
+                    }
+                }
+            }
+        }
+        // The growth of a new candidate is known from the next round on
+        std::vector<const std::string*> foundPaths;
+        for (const auto& file : found) {
+            foundPaths.push_back(&file.first);
+        }
+        std::vector<bool> listed = matchesTypes(foundPaths, options);
+        for (std::size_t i = 0; i < found.size(); ++i) {
+            if (listed[i]) {
+                candidates[found[i].first] = {found[i].second};
+            }
+        }
+
+        std::vector<std::pair<double, const std::string*>> growing;
+        for (const auto& candidate : candidates) {
+            if (candidate.second.rate > 0) {
+                growing.emplace_back(candidate.second.rate, &candidate.first);
+            }
+        }
+        std::sort(growing.begin(), growing.end(), [](const auto& a, const auto& b) {
+            return a.first > b.first || (a.first == b.first && *a.second < *b.second);
+        });
+        if (options.numFiles != -1 && growing.size() > static_cast<std::size_t>(options.numFiles)) {
+            growing.resize(options.numFiles);
+        }
+
+        std::time_t time = std::time(nullptr);
+        std::cout << "--- " << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << " ---\n";
+        for (const auto& file : growing) {
+            if (!options.bare) {
+                std::cout << formatFileSize(static_cast<uintmax_t>(file.first)) << "/s ";
+            }
+            print(candidates[*file.second].size, *file.second);
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Reads an uncompressed archive, seeking over the contents of its entries.
+ */
+class FileInput {
+public:
+    explicit FileInput(const std::string& path) : in(path, std::ios::binary) {}
+
+    explicit operator bool() const {
+        return static_cast<bool>(in);
+    }
+
+    bool read(char* buffer, std::size_t size) {
+        return static_cast<bool>(in.read(buffer, size));
+    }
+
+    bool skip(uintmax_t size) {
+        return static_cast<bool>(in.seekg(size, std::ios::cur));
+    }
+
+private:
+    std::ifstream in;
+};
+
+#ifdef LARGEST_ZLIB
+/**
+ * @brief Reads a gzip compressed archive.
+ *
+ * A compressed stream cannot be seeked, skipping the contents of an entry
+ * means decompressing it, so these archives take much longer to list.
+ */
+class GzipInput {
+public:
+    explicit GzipInput(const std::string& path) : file(gzopen(path.c_str(), "rb")) {
+        if (file) {
+            gzbuffer(file, 128 * 1024);
+        }
+    }
+
+    ~GzipInput() {
+        if (file) {
+            gzclose(file);
+        }
+    }
+
+    GzipInput(const GzipInput&) = delete;
+    GzipInput& operator=(const GzipInput&) = delete;
+
+    explicit operator bool() const {
+        return file != nullptr;
+    }
+
+    bool read(char* buffer, std::size_t size) {
+        return gzread(file, buffer, static_cast<unsigned>(size)) == static_cast<int>(size);
+    }
+
+    bool skip(uintmax_t size) {
+        discarded.resize(64 * 1024);
+        while (size > 0) {
+            unsigned chunk = static_cast<unsigned>(std::min<uintmax_t>(size, discarded.size()));
+            if (gzread(file, discarded.data(), chunk) != static_cast<int>(chunk)) {
+                return false;
+            }
+            size -= chunk;
+        }
+        return true;
+    }
+
+private:
+    gzFile file;
+    std::vector<char> discarded;
+};
+#endif
+
+/**
+ * @brief Read a little endian number of the given number of bytes.
+ */
+uint64_t littleEndian(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i) {
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return value;
+}
+
+/**
+ * @brief Read a numeric field of a tar header, in octal or, for large values, in base-256.
+ */
+uintmax_t tarNumber(const char* field, std::size_t length) {
+    uintmax_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (std::size_t i = 1; i < length; ++i) {
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    for (std::size_t i = 0; i < length && field[i] != '\0'; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+/**
+ * @brief Read a string field of a tar header, which need not be terminated.
+ */
+std::string tarString(const char* field, std::size_t length) {
+    return std::string(field, std::find(field, field + length, '\0'));
+}
+
+/**
+ * @brief List the files in a tar archive, reading only the headers.
+ *
+ * The contents of the entries are skipped. Long names and sizes from GNU
+ * and POSIX (pax) extension headers are applied to the entry that follows.
+ *
+ * @param in The archive, uncompressed or decompressed while reading.
+ * @param emit Called with the size and name of every regular file.
+ * @return false if the archive is not a tar archive or is damaged.
+ */
+template <typename Input>
+bool readTarEntries(Input& in, const std::function<void(uintmax_t, const std::string&)>& emit) {
+    const std::size_t block = 512;
+    const uintmax_t maxExtensionSize = 1 << 20; // Larger extension headers only come from damaged archives
+    std::string longName;
+    uintmax_t longSize = 0;
+    bool hasLongSize = false;
+    bool first = true;
+    char header[block];
+
+    while (in.read(header, block)) {
+        if (std::all_of(header, header + block, [](char c) { return c == '\0'; })) {
+            break; // End of archive
+        }
+
+        // The checksum is the sum of the header bytes, counting its own field as spaces
+        unsigned checksum = 0;
+        for (std::size_t i = 0; i < block; ++i) {
+            checksum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (checksum != tarNumber(header + 148, 8)) {
+            return !first;
+        }
+        first = false;
+
+        const char type = header[156];
+        uintmax_t size = hasLongSize ? longSize : tarNumber(header + 124, 12);
+        uintmax_t padding = (block - size % block) % block;
+
+        if (type == 'L' || type == 'x') {
+            // Extension headers hold data for the next entry
+            if (size > maxExtensionSize) {
+                return false;
+            }
+            std::string data(static_cast<std::size_t>(size), '\0');
+            if (!in.read(&data[0], data.size()) || !in.skip(padding)) {
+                break;
+            }
+            if (type == 'L') {
+                longName = tarString(data.data(), data.size());
+                continue;
+            }
+            // Records of a pax header look like "30 path=some/long/file/name\n"
+            for (std::size_t pos = 0; pos < data.size();) {
+                std::size_t space = data.find(' ', pos);
+                std::size_t length = std::strtoull(data.c_str() + pos, nullptr, 10);
+                if (space == std::string::npos || length == 0 || pos + length > data.size()) {
+                    break;
+                }
+                std::string record = data.substr(space + 1, pos + length - space - 2);
+                if (record.compare(0, 5, "path=") == 0) {
+                    longName = record.substr(5);
+                } else if (record.compare(0, 5, "size=") == 0) {
+                    longSize = std::strtoull(record.c_str() + 5, nullptr, 10);
+                    hasLongSize = true;
+                }
+                pos += length;
+            }
+            continue;
+        }
+
+        if (type == '0' || type == '\0' || type == '7') {
+            std::string name = longName;
+            if (name.empty()) {
+                name = tarString(header, 100);
+                std::string prefix = tarString(header + 345, 155);
+                if (std::equal(header + 257, header + 262, "ustar") && !prefix.empty()) {
+                    name = prefix + "/" + name;
+                }
+            }
+            emit(size, name);
+        }
+        longName.clear();
+        hasLongSize = false;
+        if (!in.skip(size + padding)) {
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief List the files in a zip archive from its central directory.
+ *
+ * Only the end of the archive and the central directory are read, however
+ * large the archive is. Archives in the zip64 format are supported.
+ *
+ * @param path The archive.
+ * @param emit Called with the uncompressed size and name of every file.
+ * @return false if the archive is not a zip archive.
+ */
+bool readZipEntries(const std::string& path, const std::function<void(uintmax_t, const std::string&)>& emit) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+
+    // The end of central directory record is followed by a comment of at most 64 KB
+    const std::size_t endSize = 22;
+    std::string tail(static_cast<std::size_t>(std::min<uint64_t>(fileSize, endSize + 0xffff + 20)), '\0');
+    if (tail.size() < endSize || !in.seekg(fileSize - tail.size()) || !in.read(&tail[0], tail.size())) {
+        return false;
+    }
+    std::size_t end = tail.size() - endSize + 1;
+    do {
+        end--;
+    } while (end > 0 && tail.compare(end, 4, "PK\x05\x06") != 0);
+    if (tail.compare(end, 4, "PK\x05\x06") != 0) {
+        return false;
+    }
+    uint64_t directorySize = littleEndian(&tail[end + 12], 4);
+    uint64_t directoryOffset = littleEndian(&tail[end + 16], 4);
+
+    // Zip64 archives keep the real values in a record found through a locator right before
+    if ((directorySize == 0xffffffff || directoryOffset == 0xffffffff) && end >= 20 && tail.compare(end - 20, 4, "PK\x06\x07") == 0) {
+        char record[56];
+        if (!in.seekg(littleEndian(&tail[end - 20 + 8], 8)) || !in.read(record, sizeof(record)) || std::string(record, 4) != "PK\x06\x06") {
+            return false;
+        }
+        directorySize = littleEndian(record + 40, 8);
+        directoryOffset = littleEndian(record + 48, 8);
+    }
+    if (directoryOffset + directorySize > fileSize) {
+        return false;
+    }
+
+    std::string directory(static_cast<std::size_t>(directorySize), '\0');
+    if (!in.seekg(directoryOffset) || !in.read(&directory[0], directory.size())) {
+        return false;
+    }
+    const std::size_t entrySize = 46;
+    for (std::size_t pos = 0; pos + entrySize <= directory.size() && directory.compare(pos, 4, "PK\x01\x02") == 0;) {
+        const char* entry = &directory[pos];
+        uint64_t size = littleEndian(entry + 24, 4);
+        std::size_t nameLength = littleEndian(entry + 28, 2);
+        std::size_t extraLength = littleEndian(entry + 30, 2);
+        std::size_t commentLength = littleEndian(entry + 32, 2);
+        if (pos + entrySize + nameLength + extraLength > directory.size()) {
             break;
         }
+        std::string name = directory.substr(pos + entrySize, nameLength);
+
+        // The zip64 extra field starts with the uncompressed size, if that does not fit the entry
+        const char* extra = entry + entrySize + nameLength;
+        for (std::size_t field = 0; size == 0xffffffff && field + 4 <= extraLength;) {
+            std::size_t fieldLength = littleEndian(extra + field + 2, 2);
+            if (littleEndian(extra + field, 2) == 0x0001 && fieldLength >= 8 && field + 4 + fieldLength <= extraLength) {
+                size = littleEndian(extra + field + 4, 8);
+            }
+            field += 4 + fieldLength;
+        }
+
+        if (!name.empty() && name.back() != '/') {
+            emit(size, name);
+        }
+        pos += entrySize + nameLength + extraLength + commentLength;
+    }
+    return true;
+}
+
+/**
+ * @brief List the files inside an archive.
+ *
+ * @return false if the archive cannot be read.
+ */
+bool readArchiveEntries(const std::string& path, const std::function<void(uintmax_t, const std::string&)>& emit) {
+    std::string_view name = path;
+    switch (archiveKind(name.substr(name.rfind('/') + 1))) {
+    case ArchiveKind::zip:
+        return readZipEntries(path, emit);
+    case ArchiveKind::tar: {
+        FileInput in(path);
+        return in && readTarEntries(in, emit);
+    }
+#ifdef LARGEST_ZLIB
+    case ArchiveKind::tarGz: {
+        GzipInput in(path);
+        return in && readTarEntries(in, emit);
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief List the largest files inside the zip and tar archives of a directory tree.
+ *
+ * The tree is scanned for archives first. Their entries are then listed by
+ * several threads, each taking the next archive, and ranked like files. Zip
+ * archives are listed from their central directory and tar archives from
+ * their headers, so the contents of the entries are never read, except in
+ * compressed tar archives. The entries are shown as archive!entry.
+ *
+ * @param path The directory path to start the search.
+ * @param options The options controlling the scan and the listing; the file mask applies to the entries.
+ */
+void listArchiveEntries(const fs::path& path, const ToolOptions& options) {
+    ToolOptions scanOptions = options;
+    setFileMasks(scanOptions, {"*"});
+    scanOptions.numFiles = 0;
+    std::vector<std::string> archives;
+    ScanTotals totals;
+    for (auto& result : walkTree(path, scanOptions, nullptr, nullptr, &totals)) {
+        std::move(result.archives.begin(), result.archives.end(), std::back_inserter(archives));
+    }
+    reportCoverage(totals, options);
+
+    unsigned threadCount = std::min<std::size_t>(walkerCount(options), std::max<std::size_t>(1, archives.size()));
+    std::vector<WalkResult> results(threadCount);
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> failed{0};
+    auto inspect = [&](WalkResult& result) {
+        for (std::size_t i = next++; i < archives.size(); i = next++) {
+            const std::string& archive = archives[i];
+            // A damaged archive must not take the whole listing down with it
+            bool ok;
+            try {
+                ok = readArchiveEntries(archive, [&](uintmax_t size, const std::string& name) {
+                    if (matchesMask(std::string_view(name).substr(name.rfind('/') + 1), options)) {
+                        addFile(result, size, archive + "!" + name);
+                    }
+                });
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            if (!ok) {
+                failed++;
+            }
+            if (options.numFiles != -1 && result.files.size() > 2 * static_cast<std::size_t>(options.numFiles) + 1024) {
+                keepLargest(result, options.numFiles);
+            }
+        }
+    };
+    std::vector<std::thread> inspectors;
+    for (auto& result : results) {
+        inspectors.emplace_back(inspect, std::ref(result));
+    }
+    for (auto& inspector : inspectors) {
+        inspector.join();
+    }
+
+    std::vector<std::pair<uintmax_t, std::string>> entries;
+    for (auto& result : results) {
+        for (const auto& file : result.files) {
+            entries.emplace_back(file.size, std::move(result.paths[file.index]));
+        }
+    }
+    auto larger = [](const auto& a, const auto& b) { return listedBefore(a.first, a.second, b.first, b.second); };
+    if (options.numFiles != -1 && entries.size() > static_cast<std::size_t>(options.numFiles)) {
+        std::partial_sort(entries.begin(), entries.begin() + options.numFiles, entries.end(), larger);
+        entries.resize(options.numFiles);
+    } else {
+        std::sort(entries.begin(), entries.end(), larger);
+    }
+
+    FilePrinter print(path, options);
+    for (const auto& entry : entries) {
+        print(entry.first, entry.second);
+    }
+    std::cout.flush();
+    if (failed > 0) {
+#ifdef LARGEST_ZLIB
+        std::cerr << "Skipped " << failed << " archives that could not be read\n";
+#else
+        std::cerr << "Skipped " << failed << " archives that could not be read, compressed tar archives need a build with -DLARGEST_ZLIB\n";
+#endif
+    }
+}
+
+/**
+ * @brief Format a count with thousands separators.
+ */
+std::string formatCount(double value) {
+    std::string digits = std::to_string(static_cast<uintmax_t>(std::max(0.0, value + 0.5)));
+    for (int i = static_cast<int>(digits.size()) - 3; i > 0; i -= 3) {
+        digits.insert(i, ",");
+    }
+    return digits;
+}
+
+/**
+ * @brief Files directly in one directory, as read for the estimation.
+ */
+struct DirSummary {
+    static constexpr int buckets = 16; ///< Size classes by power of ten: < 10 bytes, < 100 bytes, ..., >= 1 PB
+
+    double bytes = 0;
+    double files = 0;
+    std::array<double, buckets> histogram{};
+    std::vector<fs::path> subdirs;
+};
+
+/**
+ * @brief Running sums of one estimated quantity over all probes.
+ */
+struct EstimateSum {
+    double sum = 0;
+    double squares = 0;
+
+    void add(double value) {
+        sum += value;
+        squares += value * value;
+    }
+
+    void add(const EstimateSum& other) {
+        sum += other.sum;
+        squares += other.squares;
+    }
+
+    double mean(int probes) const {
+        return sum / probes;
+    }
+
+    /**
+     * @brief Half width of the 95% confidence interval of the mean.
+     */
+    double margin(int probes) const {
+        if (probes < 2) {
+            return 0;
+        }
+        double variance = std::max(0.0, (squares - sum * sum / probes) / (probes - 1));
+        return 1.96 * std::sqrt(variance / probes);
+    }
+};
+
+/**
+ * @brief Estimated totals, summed over the probes of one or more threads.
+ */
+struct TreeEstimate {
+    EstimateSum bytes;
+    EstimateSum files;
+    std::array<EstimateSum, DirSummary::buckets> histogram;
+    uint64_t dirsRead = 0;
+};
+
+/**
+ * @brief Read the files and subdirectories directly in a directory.
+ */
+DirSummary summarizeDirectory(const fs::path& dir, const ToolOptions& options, std::size_t rootLength) {
+    DirSummary summary;
+    std::error_code ec;
+    fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+
+    std::vector<std::pair<std::string, uintmax_t>> files;
+    for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        std::error_code entryEc;
+
+        if (entry.is_directory(entryEc) && !entry.is_symlink(entryEc)) {
+            summary.subdirs.push_back(entry.path());
+        } else if (entry.is_regular_file(entryEc) && matchesFilters(entry.path(), options, rootLength)) {
+            uintmax_t size = entry.file_size(entryEc);
+            if (!entryEc) {
+                files.emplace_back(entry.path().string(), size);
+            }
+        }
+    }
+
+    std::vector<const std::string*> paths;
+    for (const auto& file : files) {
+        paths.push_back(&file.first);
+    }
+    std::vector<bool> listed = matchesTypes(paths, options);
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        if (!listed[i]) {
+            continue;
+        }
+        const uintmax_t size = files[i].second;
+        int bucket = 0;
+        for (uintmax_t limit = 10; size >= limit && bucket < DirSummary::buckets - 1; limit *= 10) {
+            bucket++;
+        }
+        summary.bytes += size;
+        summary.files++;
+        summary.histogram[bucket]++;
+    }
+    return summary;
+}
+
+/**
+ * @brief Run random probes from the root down to a leaf directory (Knuth's estimator).
+ *
+ * Each probe descends into a randomly chosen subdirectory at every level. The
+ * files of each directory on the way count with the product of the numbers of
+ * subdirectories of all directories above it, which is the inverse of the
+ * probability of reaching it. Thus every probe is an unbiased estimate of the
+ * totals of the whole tree, and the spread of the probes gives the confidence
+ * interval. Directories are cached, as the levels near the root are read by
+ * almost every probe.
+ */
+void probeTree(const fs::path& root, const ToolOptions& options, int probes, unsigned seed, TreeEstimate& estimate) {
+    std::mt19937_64 random(seed);
+    std::unordered_map<std::string, DirSummary> cache;
+
+    for (int probe = 0; probe < probes; ++probe) {
+        double weight = 1;
+        double bytes = 0;
+        double files = 0;
+        std::array<double, DirSummary::buckets> histogram{};
+
+        fs::path dir = root;
+        for (int depth = 0;; ++depth) {
+            auto cached = cache.find(dir.native());
+            if (cached == cache.end()) {
+                cached = cache.emplace(dir.native(), summarizeDirectory(dir, options, rootPrefixLength(root))).first;
+                estimate.dirsRead++;
+            }
+            const DirSummary& summary = cached->second;
+
+            bytes += weight * summary.bytes;
+            files += weight * summary.files;
+            for (int bucket = 0; bucket < DirSummary::buckets; ++bucket) {
+                histogram[bucket] += weight * summary.histogram[bucket];
+            }
+
+            if (summary.subdirs.empty() || (options.depth != -1 && depth >= options.depth)) {
+                break;
+            }
+            weight *= summary.subdirs.size();
+            dir = summary.subdirs[std::uniform_int_distribution<std::size_t>(0, summary.subdirs.size() - 1)(random)];
+        }
+
+        estimate.bytes.add(bytes);
+        estimate.files.add(files);
+        for (int bucket = 0; bucket < DirSummary::buckets; ++bucket) {
+            estimate.histogram[bucket].add(histogram[bucket]);
+        }
+    }
+}
+
+/**
+ * @brief Estimate the total size, the number of files and their size distribution by sampling.
+ *
+ * Instead of walking the whole tree, random probes are run from the root down,
+ * spread over the walker threads. Accuracy grows with the square root of the
+ * number of probes and is reported as 95% confidence intervals.
+ *
+ * @param path The directory path to start the estimation.
+ * @param options The options controlling the estimation.
+ */
+void estimateTree(const fs::path& path, const ToolOptions& options) {
+    unsigned threadCount = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min<unsigned>(threadCount, options.estimateProbes);
+
+    std::random_device seeds;
+    std::vector<TreeEstimate> estimates(threadCount);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i) {
+        int probes = options.estimateProbes / threadCount + (i < options.estimateProbes % threadCount ? 1 : 0);
+        threads.emplace_back(probeTree, std::cref(path), std::cref(options), probes, seeds(), std::ref(estimates[i]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    TreeEstimate total;
+    for (const auto& estimate : estimates) {
+        total.bytes.add(estimate.bytes);
+        total.files.add(estimate.files);
+        for (int bucket = 0; bucket < DirSummary::buckets; ++bucket) {
+            total.histogram[bucket].add(estimate.histogram[bucket]);
+        }
+        total.dirsRead += estimate.dirsRead;
+    }
+
+    const int probes = options.estimateProbes;
+    std::cout << "Estimate from " << probes << " random probes (" << total.dirsRead << " directories read, 95% confidence):\n"
+              << "  Total size : " << formatCount(total.bytes.mean(probes)) << " bytes +/- " << formatCount(total.bytes.margin(probes)) << "\n"
+              << "  Files      : " << formatCount(total.files.mean(probes)) << " +/- " << formatCount(total.files.margin(probes)) << "\n"
+              << "  Size distribution:\n";
+
+    const char* classes[] = {"1 byte", "10 bytes", "100 bytes", "1 KB", "10 KB", "100 KB", "1 MB", "10 MB", "100 MB",
+                             "1 GB", "10 GB", "100 GB", "1 TB", "10 TB", "100 TB", "1 PB"};
+    for (int bucket = 0; bucket < DirSummary::buckets; ++bucket) {
+        if (total.histogram[bucket].sum == 0) {
+            continue;
+        }
+        std::string range = bucket == 0 ? "below 10 bytes" : bucket == DirSummary::buckets - 1
+            ? std::string("from ") + classes[bucket] : std::string(classes[bucket]) + " to " + classes[bucket + 1];
+        std::cout << "    " << std::setw(22) << std::left << range << ": "
+                  << formatCount(total.histogram[bucket].mean(probes)) << " files +/- " << formatCount(total.histogram[bucket].margin(probes)) << "\n";
+    }
+}
+
+/**
+ * @brief List the largest files of a tree scanned in shards, from the partial results of the shards.
+ *
+ * Each partial result is already sorted, so they are merged while reading,
+ * and the totals of the shards are added up. The merged listing is exact for
+ * as many files as every shard has saved.
+ *
+ * @param files The partial result files to merge.
+ * @param options The options controlling the listing.
+ */
+void mergePartialResults(const std::vector<std::string>& files, const ToolOptions& options) {
+    if (files.empty()) {
+        throw std::runtime_error("No partial results to merge");
+    }
+
+    std::vector<std::unique_ptr<RunReader>> readers;
+    std::vector<PartialResult> partials;
+    for (const auto& file : files) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Failed to read partial result " + file);
+        }
+        partials.push_back(readPartialHeader(in, file));
+        readers.push_back(std::make_unique<RunReader>(std::move(in)));
+    }
+
+    const PartialResult& first = partials.front();
+    std::vector<bool> seen(first.shardCount, false);
+    uint64_t fileCount = 0;
+    uintmax_t totalBytes = 0;
+    uint64_t dirCount = 0;
+    bool sameRoot = true;
+    for (std::size_t i = 0; i < partials.size(); ++i) {
+        const PartialResult& partial = partials[i];
+        if (partial.shardCount != first.shardCount || partial.fileMask != first.fileMask || partial.depth != first.depth
+            || partial.typeMask != first.typeMask || partial.followLinks != first.followLinks || partial.regex != first.regex) {
+            throw std::runtime_error(files[i] + " is part of a different scan than " + files.front());
+        }
+        if (partial.shardIndex < 0 || partial.shardIndex >= partial.shardCount || seen[partial.shardIndex]) {
+            throw std::runtime_error(files[i] + " holds shard " + std::to_string(partial.shardIndex) + " again");
+        }
+        seen[partial.shardIndex] = true;
+        sameRoot = sameRoot && partial.root == first.root;
+        if (partial.numFiles != -1 && (options.numFiles == -1 || options.numFiles > partial.numFiles)) {
+            std::cerr << "Warning: " << files[i] << " holds only the " << partial.numFiles << " largest files of its shard\n";
+        }
+        fileCount += partial.fileCount;
+        totalBytes += partial.totalBytes;
+        dirCount += partial.dirCount;
+    }
+    if (options.relative && !sameRoot) {
+        throw std::runtime_error("The shards were scanned from different directories, relative paths are ambiguous");
+    }
+
+    FilePrinter print(first.root, options);
+    int count = 0;
+    if (options.numFiles != 0) {
+        mergeReaders(readers, [&](uintmax_t size, const std::string& filePath) {
+            print(size, filePath);
+            count++;
+            return options.numFiles == -1 || count < options.numFiles;
+        });
     }
+    std::cout.flush();
+
+    // Every shard scans the root directory itself
+    dirCount -= partials.size() - 1;
+    std::size_t missing = std::count(seen.begin(), seen.end(), false);
+    std::cerr << "Merged " << partials.size() << " of " << first.shardCount << " shards: "
+              << fileCount << " files, " << formatFileSize(totalBytes) << " in " << dirCount << " directories"
+              << (missing > 0 ? " (shards missing, listing is incomplete)" : "") << "\n";
+}
+
+/**
+ * @brief Take the filters of a resumed scan from its checkpoint.
+ *
+ * Filters given on the command line as well must be those of the checkpoint,
+ * a scan cannot change what it lists halfway.
+ */
+void resumeFilters(ToolOptions& options, const Checkpoint& checkpoint) {
+    const bool masksGiven = options.fileMasks() != std::vector<std::string>{"*"};
+    if ((masksGiven && joinFileMasks(options.fileMasks()) != checkpoint.fileMask)
+        || (options.typeMask != 0 && options.typeMask != checkpoint.typeMask)
+        || (options.followLinks && !checkpoint.followLinks)
+        || (!options.regexSource().empty() && options.regexSource() != checkpoint.regex)) {
+        throw std::runtime_error("The file masks, --only, -L and --regex of a resumed scan are those of " + options.resumeFile);
+    }
+    setFileMasks(options, splitFileMasks(checkpoint.fileMask));
+    setRegex(options, checkpoint.regex);
+    options.typeMask = checkpoint.typeMask;
+    options.followLinks = checkpoint.followLinks;
 }
 
 int main(int argc, char *argv[]) {
-    int numFiles = 50;
-    int depth = -1; // Infinite depth by default
-    std::string fileMask = "*";
-    bool bare = false;
-    bool relative = false;
+    ToolOptions options;
+
+    // Only C++ streams are used, unsynchronized they print much faster
+    std::ios::sync_with_stdio(false);
+
+    // "largest merge" lists the partial results named on the command line instead of scanning
+    const bool merge = argc > 1 && std::string(argv[1]) == "merge";
+    std::vector<std::string> partialFiles;
+    std::string typeList;
+    std::string regex;
+    std::vector<std::string> fileMasks;
 
     // Parse command line arguments
-    for (int i = 1; i < argc; ++i) {
+    for (int i = merge ? 2 : 1; i < argc; ++i) {
         std::string arg = argv[i];
 
         if (arg == "-n") {
             if (i + 1 < argc) {
-                numFiles = std::stoi(argv[i + 1]);
-                if (numFiles < -1) {
-                    numFiles = 50; // Default value
+                options.numFiles = std::stoi(argv[i + 1]);
+                if (options.numFiles < -1) {
+                    options.numFiles = 50; // Default value
                 }
                 i++; // Skip the next argument (number of files)
             }
         } else if (arg == "-d") {
             if (i + 1 < argc) {
-                depth = std::stoi(argv[i + 1]);
-                if (depth < -1) {
-                    depth = -1; // Infinite depth by default
+                options.depth = std::stoi(argv[i + 1]);
+                if (options.depth < -1) {
+                    options.depth = -1; // Infinite depth by default
                 }
                 i++; // Skip the next argument (depth)
             }
+        } else if (arg == "-j") {
+            if (i + 1 < argc && std::string(argv[i + 1]) == "auto") {
+                options.autoThreads = true;
+                i++; // Skip the next argument (auto)
+            } else if (i + 1 < argc) {
+                options.threads = std::stoi(argv[i + 1]);
+                if (options.threads < 0) {
+                    options.threads = 0; // One thread per hardware thread by default
+                }
+                i++; // Skip the next argument (number of threads)
+            }
+        } else if (arg == "-m") {
+            if (i + 1 < argc) {
+                options.memoryLimit = std::stoull(argv[i + 1]) * 1024 * 1024;
+                i++; // Skip the next argument (memory budget)
+            }
+        } else if (arg == "--numa") {
+            options.numa = true;
+        } else if (arg == "--inode-order") {
+            if (i + 1 < argc) {
+                options.inodeBatch = std::stoi(argv[i + 1]);
+                if (options.inodeBatch < 0) {
+                    options.inodeBatch = 0; // readdir order by default
+                }
+                i++; // Skip the next argument (number of directories per batch)
+            }
+        } else if (arg == "--max-stats") {
+            if (i + 1 < argc) {
+                options.maxStats = std::max(0.0, std::stod(argv[i + 1]));
+                i++; // Skip the next argument (stat calls per second)
+            }
+        } else if (arg == "--max-dirs") {
+            if (i + 1 < argc) {
+                options.maxDirs = std::max(0.0, std::stod(argv[i + 1]));
+                i++; // Skip the next argument (directories per second)
+            }
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--estimate") {
+            if (i + 1 < argc) {
+                options.estimateProbes = std::max(0, std::stoi(argv[i + 1]));
+                i++; // Skip the next argument (number of probes)
+            }
+        } else if (arg == "--checkpoint") {
+            if (i + 1 < argc) {
+                options.checkpointFile = argv[i + 1];
+                i++; // Skip the next argument (checkpoint file)
+            }
+        } else if (arg == "--resume") {
+            if (i + 1 < argc) {
+                options.resumeFile = argv[i + 1];
+                i++; // Skip the next argument (checkpoint file)
+            }
+        } else if (arg == "--watch") {
+            if (i + 1 < argc) {
+                options.watchInterval = std::max(0.0, std::stod(argv[i + 1]));
+                i++; // Skip the next argument (seconds)
+            }
+        } else if (arg == "--grow") {
+            if (i + 1 < argc) {
+                options.growInterval = std::max(0.0, std::stod(argv[i + 1]));
+                i++; // Skip the next argument (seconds)
+            }
+        } else if (arg == "--shard") {
+            if (i + 1 < argc) {
+                std::string shard = argv[i + 1];
+                std::size_t slash = shard.find('/');
+                options.shardIndex = slash == std::string::npos ? -1 : std::stoi(shard.substr(0, slash));
+                options.shardCount = slash == std::string::npos ? 0 : std::stoi(shard.substr(slash + 1));
+                i++; // Skip the next argument (shard)
+            }
+        } else if (arg == "--save") {
+            if (i + 1 < argc) {
+                options.partialFile = argv[i + 1];
+                i++; // Skip the next argument (partial result file)
+            }
+        } else if (arg == "--archives") {
+            options.archives = true;
+        } else if (arg == "--extents") {
+            options.extents = true;
+        } else if (arg == "--compressibility") {
+            options.compressibility = true;
+        } else if (arg == "--type") {
+            options.showTypes = true;
+        } else if (arg == "--only") {
+            if (i + 1 < argc) {
+                typeList = argv[i + 1];
+                i++; // Skip the next argument (list of types)
+            }
+        } else if (arg == "--time-limit") {
+            if (i + 1 < argc) {
+                options.timeLimit = std::max(0.0, std::stod(argv[i + 1]));
+                i++; // Skip the next argument (seconds)
+            }
+        } else if (arg == "--regex") {
+            if (i + 1 < argc) {
+                regex = argv[i + 1];
+                i++; // Skip the next argument (regular expression)
+            }
+        } else if (arg == "-L") {
+            options.followLinks = true;
         } else if (arg == "-b") {
-            bare = true;
+            options.bare = true;
         } else if (arg == "-r") {
-            relative = true;
+            options.relative = true;
         } else if (arg == "-h") {
             // Display help text and exit
-            std::cout << "Usage: largest -n num -d num -b -r filemask\n"
+            std::cout << "Usage: largest -n num -d num -j num -m num -b -r filemask...\n"
+                      << "       largest merge -n num -b -r file...\n"
                       << "Options:\n"
                       << "  -n num    : Number of largest files to list (default: 50, use -1 to list all files)\n"
                       << "  -d num    : Depth of subdirectories to consider (default: -1, infinite depth)\n"
+                      << "  -j num    : Number of threads scanning directories (default: 0, one per CPU core; auto: tune while scanning)\n"
+                      << "  -m num    : Memory budget in MB, beyond it files are sorted on disk (default: 0, no limit)\n"
+                      << "  --numa    : Pin the scanning threads to CPUs spread over the NUMA nodes, each node with its own queue (Linux only)\n"
+                      << "  --inode-order num : Stat files in inode order, num directories at a time (default: 0, off)\n"
+                      << "  --max-stats num : Maximum number of stat calls per second (default: 0, no limit)\n"
+                      << "  --max-dirs num  : Maximum number of directories read per second (default: 0, no limit)\n"
+                      << "  --adaptive      : Slow down while stat latency is rising\n"
+                      << "  --time-limit num : Stop scanning after num seconds and list the largest files found so far\n"
+                      << "  --estimate num : Estimate total size, file count and size distribution from num random probes\n"
+                      << "  --checkpoint file : Save the progress of the scan to file every minute\n"
+                      << "  --resume file : Continue an interrupted scan from its checkpoint file\n"
+                      << "  --watch num : Keep watching for changes, reprinting the list at most every num seconds (Linux only)\n"
+                      << "  --grow num  : Keep listing the fastest growing files, measured every num seconds\n"
+                      << "  --shard i/N : Scan only the i-th of N parts of the tree, counting from 0\n"
+                      << "  --save file : Save the listing and totals to file for \"largest merge\" instead of printing it\n"
+                      << "  --archives  : List the largest files inside zip and tar archives instead\n"
+                      << "  --extents   : Report extents, fragments and shared bytes of the files listed (Linux only)\n"
+                      << "  --compressibility : Estimate how much compressing the files listed would save\n"
+                      << "  --type      : Show the content type of the files listed, told by their first bytes\n"
+                      << "  --only types : List only files of these content types, separated by commas:\n"
+                      << "                video, audio, image, archive, compressed, database, vm-image, document, executable, text, data, empty\n"
+                      << "  --regex expr : List only files whose relative path matches the regular expression\n"
+                      << "  -L        : Follow symbolic links to directories, scanning every directory once\n"
                       << "  -b        : Display only file paths without file sizes\n"
                       << "  -r        : Display relative paths\n"
-                      << "  filemask  : File mask to filter files (default: *)\n"
+                      << "  filemask  : File masks to filter files, a file matching any of them is listed (default: *)\n"
                       << "  -h        : Display this help text\n";
             return 0;
+        } else if (merge) {
+            partialFiles.push_back(arg);
         } else {
-            fileMask = arg;
+            fileMasks.push_back(arg);
         }
     }
 
     // Get the current working directory
     fs::path currentPath = fs::current_path();
 
-    // List the largest files
-    listLargestFiles(currentPath, fileMask, depth, numFiles, bare, relative);
+    // List the largest files, or estimate the tree
+    try {
+        if ((!options.checkpointFile.empty() || !options.resumeFile.empty()) && options.memoryLimit > 0) {
+            throw std::runtime_error("--checkpoint and --resume cannot be combined with -m");
+        }
+        if (options.shardCount < 1 || options.shardIndex < 0 || options.shardIndex >= options.shardCount) {
+            throw std::runtime_error("--shard expects i/N with 0 <= i < N");
+        }
+        if ((options.shardCount > 1 || !options.partialFile.empty()) && (!options.checkpointFile.empty() || !options.resumeFile.empty())) {
+            throw std::runtime_error("--shard and --save cannot be combined with --checkpoint or --resume");
+        }
+        // Only the listings are split into shards and saved, and the estimate reads directories without following links
+        if ((options.shardCount > 1 || !options.partialFile.empty())
+            && (options.estimateProbes > 0 || options.watchInterval > 0 || options.growInterval > 0)) {
+            throw std::runtime_error("--shard and --save cannot be combined with --estimate, --watch or --grow");
+        }
+        if (options.followLinks && options.estimateProbes > 0) {
+            throw std::runtime_error("-L cannot be combined with --estimate");
+        }
+
+        setFileMasks(options, fileMasks);
+        if (!typeList.empty()) {
+            options.typeMask = parseFileTypes(typeList);
+        }
+        setRegex(options, regex);
+#ifndef __linux__
+        if (options.extents) {
+            throw std::runtime_error("--extents is only supported on Linux");
+        }
+        if (options.numa) {
+            throw std::runtime_error("--numa is only supported on Linux");
+        }
+#endif
+
+        if (merge) {
+            mergePartialResults(partialFiles, options);
+        } else if (options.archives) {
+            listArchiveEntries(currentPath, options);
+        } else if (options.estimateProbes > 0) {
+            estimateTree(currentPath, options);
+        } else if (options.watchInterval > 0) {
+            watchLargestFiles(currentPath, options);
+        } else if (options.growInterval > 0) {
+            monitorGrowth(currentPath, options);
+        } else if (!options.resumeFile.empty()) {
+            // The checkpoint determines what is scanned, and keeps being updated
+            Checkpoint checkpoint = readCheckpoint(options.resumeFile);
+            resumeFilters(options, checkpoint);
+            options.depth = checkpoint.depth;
+            options.numFiles = checkpoint.numFiles;
+            if (options.checkpointFile.empty()) {
+                options.checkpointFile = options.resumeFile;
+            }
+            listLargestFiles(checkpoint.root, options, &checkpoint);
+        } else {
+            listLargestFiles(currentPath, options);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,2961 @@
+/**
+ * @file scanner.cpp
+ * @brief The scanner behind largest: parallel directory walkers, file filters, and sorting and merging their results.
+ */
+#include "scanner_internal.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <string_view>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <unordered_set>
+#include <map>
+#include <ctime>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <deque>
+#include <random>
+#include <stdexcept>
+
+#ifdef LARGEST_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace largest {
+
+#ifdef LARGEST_POSIX
+DirHandle::~DirHandle() {
+    close(fd);
+}
+#endif
+
+void radixSortBySize(std::vector<FileRecord>& records) {
+    const std::size_t n = records.size();
+    if (n < 2) {
+        return;
+    }
+
+    // Count the byte values of all positions in a single pass.
+    // Sizes are inverted so that an ascending sort yields descending sizes.
+    std::vector<std::size_t> counts(8 * 256, 0);
+    for (const auto& record : records) {
+        uint64_t key = ~static_cast<uint64_t>(record.size);
+        for (int byte = 0; byte < 8; ++byte) {
+            counts[byte * 256 + ((key >> (byte * 8)) & 0xff)]++;
+        }
+    }
+
+    std::vector<FileRecord> buffer(n);
+    for (int byte = 0; byte < 8; ++byte) {
+        std::size_t* count = &counts[byte * 256];
+
+        // All records share this byte, nothing to do
+        if (count[(~static_cast<uint64_t>(records[0].size) >> (byte * 8)) & 0xff] == n) {
+            continue;
+        }
+
+        // Turn the counts into bucket start offsets
+        std::size_t offset = 0;
+        for (int value = 0; value < 256; ++value) {
+            std::size_t c = count[value];
+            count[value] = offset;
+            offset += c;
+        }
+
+        for (const auto& record : records) {
+            uint64_t key = ~static_cast<uint64_t>(record.size);
+            buffer[count[(key >> (byte * 8)) & 0xff]++] = record;
+        }
+        records.swap(buffer);
+    }
+}
+
+void sortForListing(std::vector<FileRecord>& records, const std::vector<std::string>& paths) {
+    radixSortBySize(records);
+    const ListingOrder order{&paths};
+    for (auto begin = records.begin(); begin != records.end();) {
+        auto end = std::find_if(begin + 1, records.end(), [size = begin->size](const FileRecord& record) { return record.size != size; });
+        if (end - begin > 1) {
+            std::sort(begin, end, order);
+        }
+        begin = end;
+    }
+}
+
+/**
+ * @brief A regular expression compiled into a DFA, for matching paths in linear time.
+ *
+ * Supported are literals, `.`, classes like `[a-z]` and `[^/]`, the escapes
+ * `\d \w \s \D \W \S`, groups, `|`, `*`, `+`, `?`, `{m}`, `{m,}` and `{m,n}`,
+ * and the anchors `^` and `$`. As with grep, the expression may match anywhere
+ * in the path, and an anchor holds for the branch it is in: `^d|txt` matches
+ * paths that start with d or contain txt.
+ *
+ * The expression is parsed into a syntax tree, compiled into an NFA, and the
+ * NFA is turned into a DFA by subset construction, all before scanning. Bytes
+ * that no part of the expression tells apart share a column of the transition
+ * table. Matching is thus one table lookup per byte: it never backtracks, and
+ * it never allocates.
+ *
+ * The anchors are transitions on two symbols beyond the bytes, one before
+ * the path and one after it, so they can appear in any branch.
+ */
+class PathRegex {
+public:
+    explicit PathRegex(const std::string& pattern) {
+        Parser parser{pattern, 0};
+        std::unique_ptr<Node> root = parser.parseAlternation();
+        if (parser.pos < pattern.size()) {
+            throw std::runtime_error("Unbalanced ) in regular expression " + pattern);
+        }
+
+        // Without ^ a match may start after any byte
+        int start = newState();
+        ByteSet skipped = anyByte();
+        skipped.set(textStart);
+        addEdge(start, skipped, start);
+        acceptState = compile(*root, start);
+        buildDfa(start);
+    }
+
+    /**
+     * @brief Match a path given as the path of its directory and its name.
+     */
+    bool matches(std::string_view directory, std::string_view name) const {
+        uint32_t state = startState;
+        if (accepting[state]) {
+            return true;
+        }
+        state = table[state * classCount + byteClass[textStart]];
+        for (std::string_view part : {directory, name}) {
+            for (unsigned char c : part) {
+                if (state == deadState) {
+                    return false;
+                }
+                if (accepting[state]) {
+                    return true;
+                }
+                state = table[state * classCount + byteClass[c]];
+            }
+        }
+        if (accepting[state]) {
+            return true;
+        }
+        return accepting[table[state * classCount + byteClass[textEnd]]];
+    }
+
+private:
+    /// Symbols beyond the bytes: the start and the end of the path, matched by ^ and $
+    enum Symbol { textStart = 256, textEnd = 257, symbolCount = 258 };
+
+    using ByteSet = std::bitset<symbolCount>;
+
+    /**
+     * @brief All bytes, but neither the start nor the end of the path.
+     */
+    static ByteSet anyByte() {
+        ByteSet set;
+        for (int b = 0; b < 256; ++b) {
+            set.set(b);
+        }
+        return set;
+    }
+
+    /**
+     * @brief Node of the syntax tree: a set of bytes, a sequence, alternatives or a repetition.
+     */
+    struct Node {
+        enum Kind { bytes, sequence, alternatives, repetition } kind;
+        ByteSet set;
+        std::vector<std::unique_ptr<Node>> children;
+        int min = 0;
+        int max = -1; ///< -1 for no limit
+    };
+
+    /**
+     * @brief Recursive descent parser of the expression.
+     */
+    struct Parser {
+        std::string_view pattern;
+        std::size_t pos;
+
+        [[noreturn]] void fail(const std::string& message) const {
+            throw std::runtime_error(message + " in regular expression at position " + std::to_string(pos));
+        }
+
+        std::unique_ptr<Node> parseAlternation() {
+            auto node = std::make_unique<Node>(Node{Node::alternatives, {}, {}});
+            node->children.push_back(parseSequence());
+            while (pos < pattern.size() && pattern[pos] == '|') {
+                pos++;
+                node->children.push_back(parseSequence());
+            }
+            return node;
+        }
+
+        std::unique_ptr<Node> parseSequence() {
+            auto node = std::make_unique<Node>(Node{Node::sequence, {}, {}});
+            while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')') {
+                node->children.push_back(parseRepetition());
+            }
+            return node;
+        }
+
+        std::unique_ptr<Node> parseRepetition() {
+            std::unique_ptr<Node> atom = parseAtom();
+            while (pos < pattern.size()) {
+                int min;
+                int max;
+                char c = pattern[pos];
+                if (c == '*' || c == '+' || c == '?') {
+                    min = c == '+' ? 1 : 0;
+                    max = c == '?' ? 1 : -1;
+                    pos++;
+                } else if (c == '{') {
+                    pos++;
+                    min = parseNumber();
+                    max = min;
+                    if (pos < pattern.size() && pattern[pos] == ',') {
+                        pos++;
+                        max = pos < pattern.size() && pattern[pos] == '}' ? -1 : parseNumber();
+                    }
+                    if (pos >= pattern.size() || pattern[pos] != '}' || (max != -1 && max < min)) {
+                        fail("Invalid repetition");
+                    }
+                    pos++;
+                } else {
+                    break;
+                }
+                auto repetition = std::make_unique<Node>(Node{Node::repetition, {}, {}});
+                repetition->children.push_back(std::move(atom));
+                repetition->min = min;
+                repetition->max = max;
+                atom = std::move(repetition);
+            }
+            return atom;
+        }
+
+        int parseNumber() {
+            int value = 0;
+            std::size_t start = pos;
+            while (pos < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[pos])) && value <= 1000) {
+                value = value * 10 + (pattern[pos++] - '0');
+            }
+            if (pos == start || value > 1000) {
+                fail("Invalid repetition count");
+            }
+            return value;
+        }
+
+        std::unique_ptr<Node> parseAtom() {
+            auto node = std::make_unique<Node>(Node{Node::bytes, {}, {}});
+            char c = pattern[pos++];
+            switch (c) {
+            case '(':
+                node = parseAlternation();
+                if (pos >= pattern.size() || pattern[pos] != ')') {
+                    fail("Missing )");
+                }
+                pos++;
+                break;
+            case '[':
+                node->set = parseClass();
+                break;
+            case '.':
+                node->set = anyByte();
+                break;
+            case '\\':
+                node->set = parseEscape();
+                break;
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                pos--;
+                fail("Nothing to repeat");
+            case '^':
+                node->set.set(textStart);
+                break;
+            case '$':
+                node->set.set(textEnd);
+                break;
+            default:
+                node->set.set(static_cast<unsigned char>(c));
+            }
+            return node;
+        }
+
+        ByteSet parseEscape() {
+            if (pos >= pattern.size()) {
+                fail("Trailing backslash");
+            }
+            ByteSet set;
+            char c = pattern[pos++];
+            switch (std::tolower(static_cast<unsigned char>(c))) {
+            case 'd':
+                for (int b = '0'; b <= '9'; ++b) {
+                    set.set(b);
+                }
+                break;
+            case 'w':
+                for (int b = 0; b < 256; ++b) {
+                    set.set(b, std::isalnum(b) || b == '_');
+                }
+                break;
+            case 's':
+                for (char b : std::string_view(" \t\n\r\f\v")) {
+                    set.set(static_cast<unsigned char>(b));
+                }
+                break;
+            default:
+                set.set(static_cast<unsigned char>(c == 't' ? '\t' : c == 'n' ? '\n' : c));
+                return set;
+            }
+            return std::isupper(static_cast<unsigned char>(c)) ? ~set & anyByte() : set;
+        }
+
+        ByteSet parseClass() {
+            ByteSet set;
+            bool negated = pos < pattern.size() && pattern[pos] == '^';
+            if (negated) {
+                pos++;
+            }
+            bool first = true;
+            while (pos < pattern.size() && (pattern[pos] != ']' || first)) {
+                first = false;
+                if (pattern[pos] == '\\') {
+                    pos++;
+                    ByteSet escaped = parseEscape();
+                    set |= escaped;
+                    continue;
+                }
+                unsigned char low = pattern[pos++];
+                unsigned char high = low;
+                if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+                    high = pattern[pos + 1];
+                    pos += 2;
+                    if (high < low) {
+                        fail("Invalid range");
+                    }
+                }
+                for (unsigned b = low; b <= high; ++b) {
+                    set.set(b);
+                }
+            }
+            if (pos >= pattern.size()) {
+                fail("Missing ]");
+            }
+            pos++;
+            return negated ? ~set & anyByte() : set;
+        }
+    };
+
+    /**
+     * @brief NFA state: transitions on sets of bytes and transitions on nothing.
+     */
+    struct NfaState {
+        std::vector<std::pair<ByteSet, int>> edges;
+        std::vector<int> empty;
+    };
+
+    int newState() {
+        // Nested counted repetitions multiply, stop before they exhaust time and memory
+        if (nfa.size() >= maxNfaStates) {
+            throw std::runtime_error("Regular expression is too large");
+        }
+        nfa.emplace_back();
+        return static_cast<int>(nfa.size()) - 1;
+    }
+
+    void addEdge(int from, const ByteSet& set, int to) {
+        nfa[from].edges.emplace_back(set, to);
+    }
+
+    void addEmpty(int from, int to) {
+        nfa[from].empty.push_back(to);
+    }
+
+    /**
+     * @brief Compile a node into NFA states leading from the given state.
+     *
+     * @return The state reached after matching the node.
+     */
+    int compile(const Node& node, int from) {
+        switch (node.kind) {
+        case Node::bytes: {
+            int to = newState();
+            addEdge(from, node.set, to);
+            return to;
+        }
+        case Node::sequence:
+            for (const auto& child : node.children) {
+                from = compile(*child, from);
+            }
+            return from;
+        case Node::alternatives: {
+            int to = newState();
+            for (const auto& child : node.children) {
+                int start = newState();
+                addEmpty(from, start);
+                addEmpty(compile(*child, start), to);
+            }
+            return to;
+        }
+        case Node::repetition: {
+            const Node& child = *node.children.front();
+            for (int i = 0; i < node.min; ++i) {
+                from = compile(child, from);
+            }
+            if (node.max == -1) {
+                int loop = newState();
+                addEmpty(from, loop);
+                addEmpty(compile(child, loop), loop);
+                return loop;
+            }
+            int to = newState();
+            addEmpty(from, to);
+            for (int i = node.min; i < node.max; ++i) {
+                int start = newState();
+                addEmpty(from, start);
+                from = compile(child, start);
+                addEmpty(from, to);
+            }
+            return to;
+        }
+        }
+        return from;
+    }
+
+    /**
+     * @brief Add the states reachable without consuming a byte to a sorted set of states.
+     */
+    void closure(std::vector<int>& states) {
+        // A state is seen if marked with the number of this call, so the marks are never cleared
+        seenMarks.resize(nfa.size(), 0);
+        const uint32_t mark = ++closureCount;
+        std::vector<int> stack = states;
+        for (int state : states) {
+            seenMarks[state] = mark;
+        }
+        while (!stack.empty()) {
+            int state = stack.back();
+            stack.pop_back();
+            for (int next : nfa[state].empty) {
+                if (seenMarks[next] != mark) {
+                    seenMarks[next] = mark;
+                    states.push_back(next);
+                    stack.push_back(next);
+                }
+            }
+        }
+        std::sort(states.begin(), states.end());
+    }
+
+    /**
+     * @brief Build the DFA by subset construction, with one column per class of equivalent bytes.
+     */
+    void buildDfa(int start) {
+        const std::size_t maxStates = 20000;
+        // The sets of NFA states grow with long repetitions, and so does the time to build each DFA state
+        const std::size_t maxSetSizes = 4000000;
+
+        // Symbols are equivalent if every edge either takes or rejects all of them
+        std::map<std::vector<bool>, uint16_t> signatures;
+        for (int b = 0; b < symbolCount; ++b) {
+            std::vector<bool> signature;
+            for (const auto& state : nfa) {
+                for (const auto& edge : state.edges) {
+                    signature.push_back(edge.first.test(b));
+                }
+            }
+            auto inserted = signatures.emplace(signature, static_cast<uint16_t>(signatures.size()));
+            byteClass[b] = inserted.first->second;
+        }
+        classCount = signatures.size();
+        std::vector<int> representative(classCount);
+        for (int b = symbolCount - 1; b >= 0; --b) {
+            representative[byteClass[b]] = b;
+        }
+
+        std::map<std::vector<int>, uint32_t> ids;
+        std::vector<std::vector<int>> sets;
+        std::size_t setSizes = 0;
+        auto stateOf = [&](std::vector<int> states) {
+            closure(states);
+            auto found = ids.find(states);
+            if (found != ids.end()) {
+                return found->second;
+            }
+            setSizes += states.size();
+            if (sets.size() >= maxStates || setSizes > maxSetSizes) {
+                throw std::runtime_error("Regular expression is too complex");
+            }
+            uint32_t id = static_cast<uint32_t>(sets.size());
+            ids.emplace(states, id);
+            accepting.push_back(std::binary_search(states.begin(), states.end(), acceptState));
+            sets.push_back(std::move(states));
+            return id;
+        };
+
+        deadState = stateOf({});
+        startState = stateOf({start});
+        for (uint32_t id = 0; id < sets.size(); ++id) {
+            table.resize((id + 1) * classCount);
+            for (std::size_t cls = 0; cls < classCount; ++cls) {
+                std::vector<int> next;
+                for (int state : sets[id]) {
+                    for (const auto& edge : nfa[state].edges) {
+                        if (edge.first.test(representative[cls])) {
+                            next.push_back(edge.second);
+                        }
+                    }
+                }
+                std::sort(next.begin(), next.end());
+                next.erase(std::unique(next.begin(), next.end()), next.end());
+                uint32_t target = stateOf(std::move(next));
+                table[id * classCount + cls] = target;
+            }
+        }
+        nfa.clear();
+        seenMarks.clear();
+    }
+
+    static constexpr std::size_t maxNfaStates = 100000;
+    std::vector<NfaState> nfa;
+    int acceptState = 0;
+    std::vector<uint32_t> seenMarks; ///< Used by closure()
+    uint32_t closureCount = 0;
+
+    std::array<uint16_t, symbolCount> byteClass{};
+    std::size_t classCount = 0;
+    std::vector<uint32_t> table; ///< Next state by state and byte class
+    std::vector<bool> accepting;
+    uint32_t startState = 0;
+    uint32_t deadState = 0;
+};
+
+/**
+ * @brief Matches file names against many masks at once, with an Aho-Corasick automaton.
+ *
+ * The masks are put into a trie whose missing transitions are filled in from
+ * the failure links, which turns it into a DFA that finds all masks in a single
+ * pass over the name. Only bytes that occur in some mask get a column of their
+ * own in the transition table, all others share one, which keeps the table
+ * small enough for the cache even with hundreds of masks. The cost per name is
+ * one table lookup per byte, however many masks there are.
+ */
+class MaskMatcher {
+public:
+    explicit MaskMatcher(const std::vector<std::string>& masks) {
+        for (const auto& mask : masks) {
+            for (unsigned char c : mask) {
+                if (byteClass[c] == 0) {
+                    byteClass[c] = static_cast<uint8_t>(++classCount);
+                }
+            }
+        }
+        classCount++;
+
+        // Build the trie, with 0 as the root and "no transition" in its own rows
+        const uint32_t none = std::numeric_limits<uint32_t>::max();
+        table.assign(classCount, none);
+        matching.assign(1, 0);
+        for (const auto& mask : masks) {
+            uint32_t state = 0;
+            for (unsigned char c : mask) {
+                uint32_t& next = table[state * classCount + byteClass[c]];
+                if (next == none) {
+                    next = static_cast<uint32_t>(matching.size());
+                    table.resize(table.size() + classCount, none);
+                    matching.push_back(0);
+                }
+                state = table[state * classCount + byteClass[c]];
+            }
+            matching[state] = 1;
+        }
+
+        // Breadth first, every state takes the missing transitions of its failure state
+        std::vector<uint32_t> failure(matching.size(), 0);
+        std::queue<uint32_t> queue;
+        for (std::size_t cls = 0; cls < classCount; ++cls) {
+            uint32_t& next = table[cls];
+            if (next == none) {
+                next = 0;
+            } else {
+                queue.push(next);
+            }
+        }
+        while (!queue.empty()) {
+            uint32_t state = queue.front();
+            queue.pop();
+            matching[state] |= matching[failure[state]];
+            for (std::size_t cls = 0; cls < classCount; ++cls) {
+                uint32_t& next = table[state * classCount + cls];
+                uint32_t fallback = table[failure[state] * classCount + cls];
+                if (next == none) {
+                    next = fallback;
+                } else {
+                    failure[next] = fallback;
+                    queue.push(next);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Check whether a name contains any of the masks.
+     */
+    bool matches(std::string_view name) const {
+        uint32_t state = 0;
+        for (unsigned char c : name) {
+            state = table[state * classCount + byteClass[c]];
+            if (matching[state]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::array<uint8_t, 256> byteClass{}; ///< Column of each byte, 0 for bytes in no mask
+    std::size_t classCount = 0;
+    std::vector<uint32_t> table;          ///< Next state by state and byte class
+    std::vector<uint8_t> matching;        ///< Some mask ends in the state
+};
+
+/**
+ * @brief Order of pending directories in a time limited scan: largest parents first, then breadth-first.
+ */
+bool scanLater(const PendingDir& a, const PendingDir& b) {
+    return a.priority < b.priority || (a.priority == b.priority && a.depth > b.depth);
+}
+
+/**
+ * @brief Work queue of directories shared by the walker threads.
+ *
+ * Directories are handed out last in, first out, which keeps the walk roughly
+ * depth-first and the queue small. The walk is finished once the queue is empty
+ * and no thread is still scanning a directory that could add more work.
+ *
+ * In a time limited scan the queue is prioritized instead: directories whose
+ * parent held the most bytes come first, and among equals the shallower ones,
+ * so the largest files are likely found before the deadline. Once the deadline
+ * has passed, no more directories are handed out.
+ *
+ * Only walkers numbered below the active limit take work; the others are
+ * parked until the limit is raised or the walk is finished.
+ *
+ * The queue can be paused, which waits until all walkers are done with their
+ * directories, so that the pending directories and the files found so far can
+ * be saved as a consistent checkpoint.
+ *
+ * The walkers can be assigned to NUMA nodes, each node with a list of its own.
+ * Subdirectories are queued on the node of the walker that found them, where
+ * their parent's directory entries and inodes were cached, and a walker takes
+ * directories of its own node first. Only when its node has run dry does it
+ * take the oldest directory of another node, which is the root of a large
+ * subtree, so walkers rarely need to cross nodes. A time limited scan keeps a
+ * single list, as the largest directories come first across the whole tree.
+ */
+class DirQueue {
+public:
+    /**
+     * @brief Hand out directories by priority, and stop at the given deadline.
+     */
+    void setDeadline(std::chrono::steady_clock::time_point time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        deadline = time;
+        hasDeadline = true;
+    }
+
+    /**
+     * @brief Assign the walkers to NUMA nodes, before any directory is queued.
+     *
+     * @param nodes The node of each walker.
+     */
+    void setWalkerNodes(std::vector<unsigned> nodes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!hasDeadline && !nodes.empty()) {
+            pending.resize(*std::max_element(nodes.begin(), nodes.end()) + 1);
+            walkerNodes = std::move(nodes);
+        }
+    }
+
+    /**
+     * @brief Add a directory to be scanned, on the node of the walker that found it.
+     */
+    void push(PendingDir dir, unsigned worker = 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::deque<PendingDir>& list = pending[nodeOf(worker)];
+            list.push_back(std::move(dir));
+            if (hasDeadline) {
+                std::push_heap(list.begin(), list.end(), scanLater);
+            }
+            pendingCount++;
+        }
+        available.notify_one();
+    }
+
+    /**
+     * @brief Take the next directory to scan, waiting for work if necessary.
+     *
+     * @return false once the walk is finished or the deadline has passed.
+     */
+    bool pop(PendingDir& dir, unsigned worker = 0) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (expired()) {
+                return false;
+            }
+            if (worker >= activeLimit && !finished()) {
+                // Hand a possibly missed wakeup on to an active walker before parking
+                if (pendingCount > 0) {
+                    available.notify_one();
+                }
+                wait(parked, lock, [&] { return worker < activeLimit || finished() || stopped; });
+                continue;
+            }
+            wait(available, lock, [&] { return (pendingCount > 0 && !paused) || finished() || worker >= activeLimit || stopped; });
+            if (expired()) {
+                return false;
+            }
+            if (worker < activeLimit || finished()) {
+                break;
+            }
+        }
+        if (pendingCount == 0) {
+            return false;
+        }
+        take(dir, worker);
+        return true;
+    }
+
+    /**
+     * @brief Take the next directory to scan if there is one, without waiting.
+     */
+    bool tryPop(PendingDir& dir, unsigned worker = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pendingCount == 0 || paused || expired()) {
+            return false;
+        }
+        take(dir, worker);
+        return true;
+    }
+
+    /**
+     * @brief Mark directories taken by pop() or tryPop() as scanned.
+     */
+    void done(int count = 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy -= count;
+        if (finished()) {
+            available.notify_all();
+            parked.notify_all();
+        }
+        if (busy == 0) {
+            idle.notify_all();
+        }
+    }
+
+    /**
+     * @brief Stop handing out directories and wait until no walker is scanning one.
+     */
+    void pause() {
+        std::unique_lock<std::mutex> lock(mutex);
+        paused = true;
+        idle.wait(lock, [this] { return busy == 0; });
+    }
+
+    /**
+     * @brief Hand out directories again after pause().
+     */
+    void resume() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            paused = false;
+        }
+        available.notify_all();
+    }
+
+    /**
+     * @brief Get a copy of the directories not scanned yet.
+     */
+    std::vector<PendingDir> pendingDirs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<PendingDir> dirs;
+        for (const auto& list : pending) {
+            dirs.insert(dirs.end(), list.begin(), list.end());
+        }
+        return dirs;
+    }
+
+    /**
+     * @brief Set the number of walkers allowed to take work.
+     */
+    void setActiveLimit(unsigned limit) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            activeLimit = std::max(1u, limit);
+        }
+        available.notify_all();
+        parked.notify_all();
+    }
+
+    /**
+     * @brief Hand out no more directories, as if the deadline had passed.
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        available.notify_all();
+        parked.notify_all();
+    }
+
+    /**
+     * @brief Tell whether the deadline has passed or stop() was called.
+     */
+    bool isStopped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return expired();
+    }
+
+    /**
+     * @brief Get the number of directories not scanned yet.
+     */
+    std::size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pendingCount;
+    }
+
+private:
+    bool finished() const {
+        return pendingCount == 0 && busy == 0;
+    }
+
+    unsigned nodeOf(unsigned worker) const {
+        return worker < walkerNodes.size() ? walkerNodes[worker] : 0;
+    }
+
+    /**
+     * @brief Check for the deadline, waking up all walkers when it has passed.
+     */
+    bool expired() {
+        if (!stopped && hasDeadline && std::chrono::steady_clock::now() >= deadline) {
+            stopped = true;
+            available.notify_all();
+            parked.notify_all();
+        }
+        return stopped;
+    }
+
+    template <typename Predicate>
+    void wait(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, Predicate predicate) {
+        if (hasDeadline) {
+            condition.wait_until(lock, deadline, predicate);
+        } else {
+            condition.wait(lock, predicate);
+        }
+    }
+
+    /**
+     * @brief Take a directory from the walker's own node, or else the oldest one of the fullest node.
+     */
+    void take(PendingDir& dir, unsigned worker) {
+        std::deque<PendingDir>* list = &pending[nodeOf(worker)];
+        if (list->empty()) {
+            list = &*std::max_element(pending.begin(), pending.end(),
+                                      [](const auto& a, const auto& b) { return a.size() < b.size(); });
+            dir = std::move(list->front());
+            list->pop_front();
+        } else {
+            if (hasDeadline) {
+                std::pop_heap(list->begin(), list->end(), scanLater);
+            }
+            dir = std::move(list->back());
+            list->pop_back();
+        }
+        pendingCount--;
+        busy++;
+    }
+
+    std::mutex mutex;
+    std::condition_variable available;
+    std::condition_variable parked;
+    std::condition_variable idle;
+    std::vector<std::deque<PendingDir>> pending = std::vector<std::deque<PendingDir>>(1); ///< Directories by node
+    std::size_t pendingCount = 0;
+    std::vector<unsigned> walkerNodes; ///< Node of each walker, empty if all are on one node
+    int busy = 0;
+    bool paused = false;
+    unsigned activeLimit = std::numeric_limits<unsigned>::max();
+    bool hasDeadline = false;
+    bool stopped = false;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/**
+ * @brief Token bucket limiting the rate of some operation, shared by all walker threads.
+ *
+ * Each call to acquire() takes a token. When the bucket is empty, the caller
+ * reserves the next token anyway and sleeps until it becomes due, so waiting
+ * threads are served in turn. A rate of 0 means no limit.
+ */
+class RateLimiter {
+public:
+    explicit RateLimiter(double rate = 0) {
+        setRate(rate);
+    }
+
+    /**
+     * @brief Wait until the operation may be performed.
+     */
+    void acquire() {
+        std::chrono::duration<double> wait(0);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (rate <= 0) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+            last = now;
+            tokens -= 1;
+            if (tokens < 0) {
+                wait = std::chrono::duration<double>(-tokens / rate);
+            }
+        }
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+    /**
+     * @brief Change the rate, in operations per second.
+     */
+    void setRate(double newRate) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rate = newRate;
+        burst = std::max(1.0, rate / 10); // Allow bursts of a tenth of a second
+        tokens = std::min(tokens, burst);
+        last = std::chrono::steady_clock::now();
+    }
+
+    double getRate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rate;
+    }
+
+private:
+    std::mutex mutex;
+    double rate = 0;
+    double burst = 1;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+};
+
+/**
+ * @brief Limits the load a scan puts on the storage, so it can run next to production workloads.
+ *
+ * Stat calls and directory reads are rate limited separately. In adaptive mode
+ * the latency of the stat calls is measured as well: the lowest mean latency
+ * of the measuring windows of the last 10 seconds is taken as the latency of
+ * the idle device, so that it follows the tree from cached into uncached
+ * parts. If the
+ * latency rises to twice that, the device is getting busy, and the stat rate
+ * is halved. While latency stays low, the rate grows again by a tenth per window,
+ * up to the configured maximum.
+ */
+class Throttle {
+public:
+    explicit Throttle(const ListOptions& options)
+        : stats(options.maxStats), dirs(options.maxDirs), maxStats(options.maxStats), adaptive(options.adaptive),
+          limited(options.maxStats > 0 || options.maxDirs > 0 || options.adaptive) {}
+
+    /**
+     * @brief Wait until another directory may be read.
+     */
+    void enterDirectory() {
+        if (limited) {
+            dirs.acquire();
+        }
+    }
+
+    /**
+     * @brief Wait until another stat call may be issued.
+     *
+     * @return The time the stat call starts, to be passed to endStat().
+     */
+    std::chrono::steady_clock::time_point beginStat() {
+        if (!limited) {
+            return {};
+        }
+        stats.acquire();
+        return adaptive ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    }
+
+    /**
+     * @brief Report a finished stat call, adapting the stat rate in adaptive mode.
+     */
+    void endStat(std::chrono::steady_clock::time_point start) {
+        if (!adaptive) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        windowLatency += std::chrono::duration<double>(now - start).count();
+        windowCount++;
+
+        double elapsed = std::chrono::duration<double>(now - windowStart).count();
+        if (windowCount < 16 || elapsed < 0.1) {
+            return;
+        }
+
+        // The idle latency is the lowest of the recent windows, so that a stretch of cached
+        // metadata does not set a baseline the rest of the tree can never reach
+        double latency = windowLatency / windowCount;
+        double observedRate = windowCount / elapsed;
+        recentLatencies.emplace_back(now, latency);
+        while (now - recentLatencies.front().first > baselineSpan) {
+            recentLatencies.pop_front();
+        }
+        double baseline = latency;
+        for (const auto& window : recentLatencies) {
+            baseline = std::min(baseline, window.second);
+        }
+
+        double rate = stats.getRate();
+        if (latency > 2 * baseline) {
+            // The device is getting busy, back off
+            double current = rate > 0 ? std::min(rate, observedRate) : observedRate;
+            stats.setRate(std::max(minRate, current / 2));
+        } else if (rate > 0) {
+            double increased = rate * 1.1;
+            stats.setRate(maxStats > 0 ? std::min(maxStats, increased) : increased);
+        }
+
+        windowStart = now;
+        windowLatency = 0;
+        windowCount = 0;
+    }
+
+private:
+    static constexpr double minRate = 10;
+    static constexpr std::chrono::seconds baselineSpan{10}; ///< How long a window counts for the idle latency
+
+    RateLimiter stats;
+    RateLimiter dirs;
+    double maxStats;
+    bool adaptive;
+    bool limited;
+
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point windowStart = std::chrono::steady_clock::now();
+    double windowLatency = 0;
+    int windowCount = 0;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, double>> recentLatencies; ///< Mean latency of the recent windows
+};
+
+/**
+ * @brief Strip trailing separators from a scan root, so that paths below it have a single separator after it.
+ */
+fs::path trimRoot(const fs::path& root) {
+    std::string path = root.string();
+    const std::size_t rootLength = root.root_path().string().size();
+    while (path.size() > rootLength && (path.back() == '/' || path.back() == fs::path::preferred_separator)) {
+        path.pop_back();
+    }
+    return path;
+}
+
+std::size_t rootPrefixLength(const fs::path& root) {
+    const fs::path trimmed = trimRoot(root);
+    return trimmed.string().size() + (trimmed.has_relative_path() ? 1 : 0);
+}
+
+/**
+ * @brief Directories already scanned, shared by all walker threads to detect cycles when following links.
+ *
+ * A directory is identified by its device and inode on POSIX systems, and by
+ * its canonical path elsewhere. The set is split into shards by the hash of
+ * the key, each with its own lock, so walkers rarely wait for each other.
+ */
+class VisitedDirs {
+public:
+    using Key = DirKey;
+
+    /**
+     * @brief Add a directory to the set.
+     *
+     * @return false if it was visited before.
+     */
+    bool insert(Key key) {
+        std::size_t hash = KeyHash()(key);
+        Shard& shard = shards[hash % shardCount];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.keys.insert(std::move(key)).second;
+    }
+
+    /**
+     * @brief The directories in the set, to save them in a checkpoint.
+     */
+    std::vector<Key> keys() {
+        std::vector<Key> result;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.insert(result.end(), shard.keys.begin(), shard.keys.end());
+        }
+        return result;
+    }
+
+private:
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const {
+#ifdef LARGEST_POSIX
+            return std::hash<uint64_t>()(key.second * 0x9e3779b97f4a7c15ull ^ key.first);
+#else
+            return std::hash<std::string>()(key);
+#endif
+        }
+    };
+
+    /**
+     * @brief Part of the set, kept on its own cache line.
+     */
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_set<Key, KeyHash> keys;
+    };
+
+    static constexpr std::size_t shardCount = 64;
+    std::array<Shard, shardCount> shards;
+};
+
+/**
+ * @brief State shared by all walker threads.
+ */
+struct WalkContext {
+    explicit WalkContext(const ToolOptions& options) : options(options), throttle(options) {}
+
+    const ToolOptions& options;
+    DirQueue queue;
+    Throttle throttle;
+    SpillArea* spillArea = nullptr; ///< Where to spill runs, if there is a memory budget
+    std::size_t memoryLimit = 0;    ///< Memory budget of each walker thread
+    VisitedDirs visited;            ///< Directories scanned, when following links
+    std::mutex linksMutex;
+    std::vector<PendingDir> links;  ///< Links to directories found in this round of the walk, followed in the next one
+
+    /**
+     * @brief Files of an unbounded listing saved to the list file of its checkpoint so far.
+     */
+    struct SavedList {
+        fs::path file;                  ///< Empty until the walk has started or taken over the list
+        std::vector<std::size_t> saved; ///< Files of each walk result in the list
+        uint64_t count = 0;             ///< Records in the list
+        uint64_t bytes = 0;             ///< Length of the records, anything after them is left over from an interrupted write
+    };
+    SavedList savedList;
+    std::vector<int> walkerCpus;    ///< CPU each walker is pinned to, empty if not pinned
+    std::size_t rootLength = 0;     ///< Length of the scan root and its separator, the prefix of all paths
+    const FileSink* sink = nullptr; ///< Where to pass the files found, if they are not collected
+    const DirHook* dirHook = nullptr; ///< Told about every directory before it is read, if not nullptr
+    std::mutex dirHookMutex;
+    std::mutex sinkMutex;
+    bool sinkDone = false;          ///< The sink wants no more files
+
+    /// Files modified since then count as recently modified
+    const std::time_t recentSince = std::time(nullptr) - recentWindow.count();
+    const fs::file_time_type recentSinceFileTime = fs::file_time_type::clock::now() - recentWindow;
+
+    /**
+     * @brief Work done by one walker, kept on its own cache line.
+     */
+    struct alignas(64) Progress {
+        std::atomic<uint64_t> entries{0};
+        std::atomic<uint64_t> dirs{0};
+    };
+    std::vector<Progress> progress; ///< Entries and directories read by each walker
+};
+
+void writeRecord(std::ostream& out, uintmax_t size, const std::string& path) {
+    uint64_t fileSize = size;
+    uint32_t length = static_cast<uint32_t>(path.size());
+    out.write(reinterpret_cast<const char*>(&fileSize), sizeof(fileSize));
+    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.write(path.data(), length);
+}
+
+bool readRecord(std::istream& in, uintmax_t& size, std::string& path) {
+    uint64_t fileSize;
+    uint32_t length;
+    if (!in.read(reinterpret_cast<char*>(&fileSize), sizeof(fileSize)) || !in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+        return false;
+    }
+    size = fileSize;
+    path.resize(length);
+    return static_cast<bool>(in.read(&path[0], length));
+}
+
+/**
+ * @brief Write the files of a walk result, in their current order, to a run file.
+ */
+void writeRun(const fs::path& runFile, const WalkResult& result) {
+    std::ofstream out(runFile, std::ios::binary);
+    for (const auto& file : result.files) {
+        writeRecord(out, file.size, result.paths[file.index]);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write temporary file " + runFile.string());
+    }
+}
+
+/**
+ * @brief Sort the files held in memory and spill them to a new run file.
+ */
+void spillRun(WalkResult& result, SpillArea& spillArea) {
+    sortForListing(result.files, result.paths);
+    result.runs.push_back(spillArea.newRun());
+    writeRun(result.runs.back(), result);
+    result.paths = {};
+    result.files = {};
+    result.bytes = 0;
+    result.typedPaths = 0;
+}
+
+void mergeReaders(std::vector<std::unique_ptr<RunReader>>& readers, const FileSink& emit) {
+    // Heap of the readers by their current file in listing order, the same file in several runs by run order
+    auto after = [&readers](std::size_t a, std::size_t b) {
+        const RunReader& first = *readers[a];
+        const RunReader& second = *readers[b];
+        if (first.size == second.size && first.path == second.path) {
+            return a > b;
+        }
+        return listedBefore(second.size, second.path, first.size, first.path);
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(after)> heap(after);
+    for (std::size_t i = 0; i < readers.size(); ++i) {
+        if (readers[i]->valid) {
+            heap.push(i);
+        }
+    }
+
+    while (!heap.empty()) {
+        std::size_t i = heap.top();
+        heap.pop();
+        if (!emit(readers[i]->size, readers[i]->path)) {
+            return;
+        }
+        if (readers[i]->next()) {
+            heap.push(i);
+        }
+    }
+}
+
+void mergeRunFiles(std::vector<fs::path> runs, SpillArea& spillArea, const FileSink& emit) {
+    const std::size_t maxOpenRuns = 256;
+
+    auto merge = [](const std::vector<fs::path>& group, const FileSink& sink) {
+        std::vector<std::unique_ptr<RunReader>> readers;
+        for (const auto& run : group) {
+            readers.push_back(std::make_unique<RunReader>(run));
+        }
+        mergeReaders(readers, sink);
+    };
+
+    while (runs.size() > maxOpenRuns) {
+        std::vector<fs::path> group(runs.begin(), runs.begin() + maxOpenRuns);
+        fs::path mergedRun = spillArea.newRun();
+        {
+            std::ofstream out(mergedRun, std::ios::binary);
+            merge(group, [&out](uintmax_t size, const std::string& path) {
+                writeRecord(out, size, path);
+                return true;
+            });
+            if (!out) {
+                throw std::runtime_error("Failed to write temporary file " + mergedRun.string());
+            }
+        }
+        for (const auto& run : group) {
+            fs::remove(run);
+        }
+        runs.erase(runs.begin(), runs.begin() + maxOpenRuns);
+        runs.push_back(mergedRun);
+    }
+
+    merge(runs, emit);
+}
+
+ArchiveKind archiveKind(std::string_view fileName) {
+    auto endsWith = [fileName](std::string_view suffix) {
+        return fileName.size() > suffix.size() && fileName.substr(fileName.size() - suffix.size()) == suffix;
+    };
+    if (endsWith(".zip") || endsWith(".jar")) {
+        return ArchiveKind::zip;
+    }
+    if (endsWith(".tar")) {
+        return ArchiveKind::tar;
+    }
+    if (endsWith(".tar.gz") || endsWith(".tgz")) {
+        return ArchiveKind::tarGz;
+    }
+    return ArchiveKind::none;
+}
+
+uint32_t parseFileTypes(const std::string& list) {
+    uint32_t mask = 0;
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        auto type = std::find_if(std::begin(fileTypeNames), std::end(fileTypeNames), [&name](const char* typeName) { return name == typeName; });
+        if (type == std::end(fileTypeNames)) {
+            throw std::runtime_error("Unknown file type " + name);
+        }
+        mask |= 1u << (type - std::begin(fileTypeNames));
+    }
+    return mask;
+}
+
+/**
+ * @brief Tell the type of a file from its first bytes.
+ *
+ * @param header The first bytes of the file, up to 4 KB.
+ */
+FileType classifyHeader(std::string_view header) {
+    auto at = [&header](std::size_t offset, std::string_view magic) {
+        return header.size() >= offset + magic.size() && header.substr(offset, magic.size()) == magic;
+    };
+    using namespace std::string_view_literals;
+
+    if (header.empty()) {
+        return FileType::empty;
+    }
+    if (at(4, "ftyp")) {
+        // ISO media files hold images and audio as well as video, the brand tells
+        if (at(8, "heic") || at(8, "heix") || at(8, "mif1") || at(8, "avif")) {
+            return FileType::image;
+        }
+        return at(8, "M4A ") ? FileType::audio : FileType::video;
+    }
+    if (at(0, "\x1a\x45\xdf\xa3") || (at(0, "RIFF") && at(8, "AVI ")) || at(0, "FLV\x01") || at(0, "\x00\x00\x01\xba"sv) || at(0, "\x00\x00\x01\xb3"sv)
+        || (at(0, "\x47") && at(188, "\x47"))) {
+        return FileType::video;
+    }
+    if (at(0, "ID3") || at(0, "\xff\xfb") || at(0, "\xff\xf3") || at(0, "fLaC") || at(0, "OggS") || (at(0, "RIFF") && at(8, "WAVE"))) {
+        return FileType::audio;
+    }
+    if (at(0, "\xff\xd8\xff") || at(0, "\x89PNG") || at(0, "GIF8") || at(0, "II*\x00"sv) || at(0, "MM\x00*"sv) || (at(0, "RIFF") && at(8, "WEBP"))) {
+        return FileType::image;
+    }
+    if (at(0, "PK\x03\x04") || at(257, "ustar") || at(0, "7z\xbc\xaf\x27\x1c") || at(0, "Rar!\x1a\x07") || at(0, "!<arch>\n")) {
+        return FileType::archive;
+    }
+    if (at(0, "\x1f\x8b") || at(0, "BZh") || at(0, "\xfd" "7zXZ\x00"sv) || at(0, "\x28\xb5\x2f\xfd") || at(0, "\x04\x22\x4d\x18")) {
+        return FileType::compressed;
+    }
+    if (at(0, "SQLite format 3\x00"sv) || at(0, "PAR1") || at(4, "Standard Jet DB") || at(4, "Standard ACE DB")) {
+        return FileType::database;
+    }
+    if (at(0, "QFI\xfb") || at(0, "vhdxfile") || at(0, "conectix") || at(0, "KDMV") || at(64, "\x7f\x10\xda\xbe")) {
+        return FileType::vmImage;
+    }
+    if (at(0, "%PDF") || at(0, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1")) {
+        return FileType::document;
+    }
+    if (at(0, "\x7f" "ELF") || at(0, "MZ") || at(0, "\xfe\xed\xfa\xce") || at(0, "\xfe\xed\xfa\xcf") || at(0, "\xce\xfa\xed\xfe") || at(0, "\xcf\xfa\xed\xfe")) {
+        return FileType::executable;
+    }
+
+    // Text has no NUL bytes and hardly any control characters; bytes of UTF-8 sequences are fine
+    std::size_t control = 0;
+    for (unsigned char c : header) {
+        if (c == 0) {
+            return FileType::data;
+        }
+        if (c < 0x20 && c != '\n' && c != '\r' && c != '\t' && c != '\f' && c != 0x1b) {
+            control++;
+        }
+    }
+    return control * 100 < header.size() ? FileType::text : FileType::data;
+}
+
+std::vector<FileType> classifyFiles(const std::vector<const std::string*>& paths) {
+    const std::size_t headerSize = 4096;
+    std::vector<FileType> types(paths.size(), FileType::data);
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+#if defined(LARGEST_POSIX) && defined(POSIX_FADV_WILLNEED)
+        int fd = open(paths[i]->c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, headerSize, POSIX_FADV_WILLNEED);
+            close(fd); // The pages asked for stay in the cache
+        }
+#endif
+    }
+
+    std::string header(headerSize, '\0');
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        std::ifstream in(*paths[i], std::ios::binary);
+        if (!in) {
+            continue;
+        }
+        in.read(&header[0], headerSize);
+        FileType type = classifyHeader(std::string_view(header.data(), static_cast<std::size_t>(in.gcount())));
+
+        // ISO 9660 images have their signature after 32 KB of system area
+        if (type == FileType::data) {
+            char signature[5];
+            in.clear();
+            if (in.seekg(32769) && in.read(signature, sizeof(signature)) && std::string_view(signature, sizeof(signature)) == "CD001") {
+                type = FileType::vmImage;
+            }
+        }
+        types[i] = type;
+    }
+    return types;
+}
+
+bool matchesMask(std::string_view fileName, const ListOptions& options) {
+    if (options.maskMatcher) {
+        return options.maskMatcher->matches(fileName);
+    }
+    const std::string& mask = options.masks.front();
+    return mask == "*" || fileName.find(mask) != std::string_view::npos;
+}
+
+void setFileMasks(ListOptions& options, std::vector<std::string> masks) {
+    if (masks.empty() || std::any_of(masks.begin(), masks.end(), [](const std::string& mask) { return mask == "*" || mask.empty(); })) {
+        masks = {"*"};
+    }
+    options.maskMatcher = masks.size() > 1 ? std::make_shared<const MaskMatcher>(masks) : nullptr;
+    options.masks = std::move(masks);
+}
+
+void setRegex(ListOptions& options, const std::string& expression) {
+    options.regex = expression.empty() ? nullptr : std::make_shared<const PathRegex>(expression);
+    options.expression = expression;
+}
+
+std::string joinFileMasks(const std::vector<std::string>& masks) {
+    std::string joined;
+    for (const auto& mask : masks) {
+        joined += (joined.empty() ? "" : std::string(1, '\0')) + mask;
+    }
+    return joined;
+}
+
+std::vector<std::string> splitFileMasks(const std::string& joined) {
+    std::vector<std::string> masks;
+    std::size_t start = 0;
+    for (std::size_t end; (end = joined.find('\0', start)) != std::string::npos; start = end + 1) {
+        masks.push_back(joined.substr(start, end - start));
+    }
+    masks.push_back(joined.substr(start));
+    return masks;
+}
+
+bool matchesFilters(std::string_view directory, std::string_view name, const ListOptions& options, std::size_t rootLength) {
+    if (!matchesMask(name, options)) {
+        return false;
+    }
+    if (!options.regex) {
+        return true;
+    }
+    directory.remove_prefix(std::min(rootLength, directory.size()));
+    return options.regex->matches(directory, name);
+}
+
+bool matchesFilters(const fs::path& path, const ListOptions& options, std::size_t rootLength) {
+    const std::string& full = path.native();
+    std::size_t nameLength = path.filename().native().size();
+    return matchesFilters(std::string_view(full).substr(0, full.size() - nameLength), std::string_view(full).substr(full.size() - nameLength), options, rootLength);
+}
+
+/**
+ * @brief Check whether an entry of the scan root belongs to the part of the tree to scan.
+ *
+ * The entries of the root are assigned to the shards by the FNV-1a hash of
+ * their name, everything below them goes with them. The assignment depends on
+ * nothing but the names, so independent processes agree on it.
+ *
+ * @param depth The depth of the directory holding the entry.
+ * @param name The name of the entry.
+ */
+bool inShard(int depth, std::string_view name, const ListOptions& options) {
+    if (options.shardCount <= 1 || depth > 0) {
+        return true;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : name) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash % options.shardCount == static_cast<uint64_t>(options.shardIndex);
+}
+
+void addFile(WalkResult& result, uintmax_t size, std::string path) {
+    result.files.push_back({size, result.paths.size()});
+    result.bytes += sizeof(FileRecord) + sizeof(std::string) + path.size();
+    result.paths.push_back(std::move(path));
+}
+
+/**
+ * @brief Record and count a file found by a walker, or pass it on to the sink of the walk.
+ *
+ * Files passed on are filtered by type here, as they are not collected for
+ * keepLargestOfTypes(), and counted only if the sink still takes files.
+ */
+void keepFile(WalkContext& context, WalkResult& result, uintmax_t size, std::string path) {
+    if (!context.sink) {
+        result.fileCount++;
+        result.totalBytes += size;
+        addFile(result, size, std::move(path));
+        return;
+    }
+    const uint32_t typeMask = context.options.typeMask;
+    if (typeMask != 0 && !(typeMask & (1u << static_cast<int>(classifyFiles({&path}).front())))) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(context.sinkMutex);
+    if (context.sinkDone) {
+        return;
+    }
+    result.fileCount++;
+    result.totalBytes += size;
+    if (!(*context.sink)(size, path)) {
+        context.sinkDone = true;
+        context.queue.stop();
+    }
+}
+
+/**
+ * @brief Drop the paths of the files no longer in a walk result, keeping them in the order of the files.
+ */
+void compactPaths(WalkResult& result) {
+    std::vector<std::string> paths;
+    paths.reserve(result.files.size());
+    result.bytes = 0;
+    for (auto& file : result.files) {
+        paths.push_back(std::move(result.paths[file.index]));
+        file.index = paths.size() - 1;
+        result.bytes += sizeof(FileRecord) + sizeof(std::string) + paths.back().size();
+    }
+    result.paths.swap(paths);
+}
+
+void keepLargest(WalkResult& result, std::size_t n) {
+    if (result.files.size() <= n) {
+        return;
+    }
+    std::nth_element(result.files.begin(), result.files.begin() + n, result.files.end(), ListingOrder{&result.paths});
+    result.files.resize(n);
+    compactPaths(result);
+}
+
+/**
+ * @brief Drop all files but the n largest of the types asked for.
+ *
+ * The files are classified from the largest down, in batches, until n files of
+ * the types asked for are found. Thus only files that are large enough to make
+ * it into the listing are read, and each of them only once: the files kept are
+ * moved to the front of the paths, where they are known to be of the right type.
+ * If all files are kept, as for a listing of all files, only the files found
+ * since the last call are classified, in the order they were found, and nothing
+ * is sorted, so that calling this as files come in costs linear time overall.
+ */
+void keepLargestOfTypes(WalkResult& result, std::size_t n, uint32_t typeMask) {
+    const std::size_t batchSize = 64;
+    if (n >= result.files.size()) {
+        // The files below typedPaths are the first ones, the rest follow in the order of their paths
+        std::size_t kept = result.typedPaths;
+        for (std::size_t start = result.typedPaths; start < result.files.size(); start += batchSize) {
+            std::size_t end = std::min(result.files.size(), start + batchSize);
+            std::vector<const std::string*> unknown;
+            for (std::size_t i = start; i < end; ++i) {
+                unknown.push_back(&result.paths[result.files[i].index]);
+            }
+            std::vector<FileType> types = classifyFiles(unknown);
+
+            for (std::size_t i = start; i < end; ++i) {
+                const FileRecord file = result.files[i];
+                if (!(typeMask & (1u << static_cast<int>(types[i - start])))) {
+                    result.bytes -= sizeof(FileRecord) + sizeof(std::string) + result.paths[file.index].size();
+                    continue;
+                }
+                if (file.index != kept) {
+                    result.paths[kept] = std::move(result.paths[file.index]);
+                }
+                result.files[kept] = {file.size, kept};
+                kept++;
+            }
+        }
+        result.files.resize(kept);
+        result.paths.resize(kept);
+        result.typedPaths = kept;
+        return;
+    }
+
+    std::sort(result.files.begin(), result.files.end(), ListingOrder{&result.paths});
+
+    std::vector<FileRecord> kept;
+    for (std::size_t start = 0; start < result.files.size() && kept.size() < n; start += batchSize) {
+        std::size_t end = std::min(result.files.size(), start + batchSize);
+        std::vector<const std::string*> unknown;
+        for (std::size_t i = start; i < end; ++i) {
+            if (result.files[i].index >= result.typedPaths) {
+                unknown.push_back(&result.paths[result.files[i].index]);
+            }
+        }
+        std::vector<FileType> types = classifyFiles(unknown);
+
+        for (std::size_t i = start, j = 0; i < end && kept.size() < n; ++i) {
+            const FileRecord& file = result.files[i];
+            if (file.index < result.typedPaths || (typeMask & (1u << static_cast<int>(types[j++])))) {
+                kept.push_back(file);
+            }
+        }
+    }
+    result.files.swap(kept);
+    compactPaths(result);
+    result.typedPaths = result.paths.size();
+}
+
+/**
+ * @brief Tell the directory hook, if any, about a directory about to be read.
+ */
+void announceDirectory(WalkContext& context, const PendingDir& dir) {
+    if (context.dirHook) {
+        std::lock_guard<std::mutex> lock(context.dirHookMutex);
+        (*context.dirHook)(dir.path, dir.depth);
+    }
+}
+
+/**
+ * @brief Keep a link to a directory for the next round of the walk, with -L.
+ */
+void deferLink(WalkContext& context, PendingDir dir) {
+    std::lock_guard<std::mutex> lock(context.linksMutex);
+    context.links.push_back(std::move(dir));
+}
+
+/**
+ * @brief Start the next round of a walk with -L: queue the directories the links of the last round lead to.
+ *
+ * Links are followed only once the walkers are done with the directories found
+ * without them, in path order, and their targets are claimed in the visited set
+ * before any of them is scanned. So the path a directory is listed under does
+ * not depend on which walker gets there first: a directory reachable without
+ * links keeps its own path, and one reached by several links of a round is
+ * scanned through the first of them.
+ *
+ * @return false if there were no links to follow.
+ */
+bool followLinks(WalkContext& context) {
+    std::lock_guard<std::mutex> lock(context.linksMutex);
+    if (context.links.empty()) {
+        return false;
+    }
+    std::sort(context.links.begin(), context.links.end(), [](const PendingDir& a, const PendingDir& b) { return a.path < b.path; });
+    for (auto& link : context.links) {
+#ifdef LARGEST_POSIX
+        struct stat info;
+        if (stat(link.path.c_str(), &info) == 0) {
+            if (!context.visited.insert({info.st_dev, info.st_ino})) {
+                continue; // Visited before, through a link or not
+            }
+            link.claimed = true;
+        }
+#else
+        std::error_code ec;
+        std::string target = fs::canonical(link.path, ec).string();
+        if (!ec) {
+            if (!context.visited.insert(std::move(target))) {
+                continue;
+            }
+            link.claimed = true;
+        }
+#endif
+        // A link that cannot be resolved fails when opened, and is counted then
+        context.queue.push(std::move(link));
+    }
+    context.links.clear();
+    return true;
+}
+
+/**
+ * @brief Subdirectories found in a batch, queued only once their parent's bytes are known.
+ *
+ * In a prioritized queue a directory is ranked by the bytes found directly in
+ * its parent. Otherwise subdirectories are queued right away, so that other
+ * walkers can start on them while the files of the parent are still stat'ed.
+ */
+class ChildDirs {
+public:
+    ChildDirs(DirQueue& queue, std::size_t batchSize, bool prioritized, unsigned worker)
+        : queue(queue), parentBytes(batchSize, 0), prioritized(prioritized), worker(worker) {}
+
+    /**
+     * @brief Queue a subdirectory of the directory at the given index in the batch.
+     */
+    void add(std::size_t parent, PendingDir dir) {
+        if (prioritized) {
+#ifdef LARGEST_POSIX
+            // A prioritized queue is taken breadth first, pinning every parent
+            // on the frontier would run out of file descriptors
+            dir.parent = nullptr;
+#endif
+            children.emplace_back(parent, std::move(dir));
+        } else {
+            queue.push(std::move(dir), worker);
+        }
+    }
+
+    /**
+     * @brief Count bytes found directly in the directory at the given index in the batch.
+     */
+    void addBytes(std::size_t parent, uintmax_t bytes) {
+        parentBytes[parent] += bytes;
+    }
+
+    ~ChildDirs() {
+        for (auto& child : children) {
+            child.second.priority = parentBytes[child.first];
+            queue.push(std::move(child.second), worker);
+        }
+    }
+
+private:
+    DirQueue& queue;
+    std::vector<uintmax_t> parentBytes;
+    std::vector<std::pair<std::size_t, PendingDir>> children;
+    bool prioritized;
+    unsigned worker; ///< The walker that found the subdirectories
+};
+
+#ifdef LARGEST_POSIX
+/**
+ * @brief A directory entry waiting to be stat'ed.
+ */
+struct StatRequest {
+    ino_t inode;
+    std::size_t dir;        ///< Index of the entry's directory within the batch
+    std::string path;
+    std::size_t nameOffset; ///< Start of the file name within the path
+    bool typeKnown;         ///< Known to be a regular file or a symbolic link
+};
+
+/**
+ * @brief Open a pending directory.
+ *
+ * The directory is opened relative to its parent if that is still open, so
+ * the kernel never has to resolve the full path again, and trees deeper than
+ * PATH_MAX can be scanned as well. Otherwise it is opened by its path. When
+ * following links, a directory that was visited before, through a link or not,
+ * is not opened again, which also breaks cycles. Directories that cannot be
+ * opened are counted in the walk result.
+ *
+ * @return The open directory, or nullptr if it cannot be opened or was visited before.
+ */
+std::shared_ptr<DirHandle> openDirectory(const PendingDir& dir, WalkContext& context, WalkResult& result) {
+    const bool follow = context.options.followLinks;
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW);
+    int fd;
+    if (dir.parent) {
+        fd = openat(dir.parent->fd, dir.path.c_str() + dir.path.rfind('/') + 1, flags);
+    } else {
+        // The root itself may be a link
+        fd = open(dir.path.c_str(), dir.depth == 0 ? flags & ~O_NOFOLLOW : flags);
+    }
+    if (fd < 0) {
+        result.failedDirs++;
+        return nullptr;
+    }
+    auto handle = std::make_shared<DirHandle>(fd);
+
+    struct stat info;
+    if (follow && !dir.claimed && (fstat(fd, &info) != 0 || !context.visited.insert({info.st_dev, info.st_ino}))) {
+        return nullptr;
+    }
+    return handle;
+}
+
+/**
+ * @brief Scan a batch of directories: record matching files and queue their subdirectories.
+ *
+ * All directories of the batch are read first, queueing subdirectories right
+ * away and collecting the entries that need a stat. These are then stat'ed with
+ * fstatat() relative to their directory. With inode ordering, the stats of the
+ * whole batch are issued in inode order, which turns random seeks across the
+ * inode tables of a spinning disk into a mostly sequential sweep.
+ * A directory stays open as long as some of its subdirectories are pending.
+ *
+ * @return The number of entries read, as a measure of the work done.
+ */
+std::size_t scanDirectories(const std::vector<PendingDir>& batch, WalkContext& context, WalkResult& result, unsigned worker) {
+    const ToolOptions& options = context.options;
+    ChildDirs children(context.queue, batch.size(), options.timeLimit > 0, worker);
+    std::vector<std::shared_ptr<DirHandle>> handles(batch.size());
+    std::vector<StatRequest> requests;
+    std::size_t entries = 0;
+
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const PendingDir& dir = batch[i];
+        context.throttle.enterDirectory();
+        handles[i] = openDirectory(dir, context, result);
+        if (!handles[i]) {
+            continue;
+        }
+        announceDirectory(context, dir);
+
+        // The stream takes its own descriptor, so the handle stays usable for the subdirectories
+        int streamFd = dup(handles[i]->fd);
+        DIR* stream = streamFd < 0 ? nullptr : fdopendir(streamFd);
+        if (!stream) {
+            if (streamFd >= 0) {
+                close(streamFd);
+            }
+            result.failedDirs++;
+            continue;
+        }
+
+        const std::string prefix = dir.path.back() == '/' ? dir.path : dir.path + '/';
+        while (const dirent* entry = readdir(stream)) {
+            const char* name = entry->d_name;
+            entries++;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (!inShard(dir.depth, name, options)) {
+                continue;
+            }
+
+            // Not every file system reports the type while reading the directory
+            unsigned char type = entry->d_type;
+            if (type == DT_DIR) {
+                if (options.depth == -1 || dir.depth < options.depth) {
+                    children.add(i, {prefix + name, dir.depth + 1, handles[i]});
+                }
+            } else if (type == DT_UNKNOWN || (type == DT_LNK && options.followLinks)
+                       || ((type == DT_REG || type == DT_LNK) && matchesFilters(prefix, name, options, context.rootLength))) {
+                requests.push_back({entry->d_ino, i, prefix + name, prefix.size(), type != DT_UNKNOWN});
+            }
+        }
+        closedir(stream);
+    }
+
+    if (options.inodeBatch > 0) {
+        std::sort(requests.begin(), requests.end(), [](const StatRequest& a, const StatRequest& b) { return a.inode < b.inode; });
+    }
+
+    auto foundFile = [&](StatRequest& request, const struct stat& info) {
+        children.addBytes(request.dir, info.st_size);
+        if (options.growInterval > 0 && info.st_mtime >= context.recentSince) {
+            result.recent.push_back(request.path);
+        }
+        if (options.archives && archiveKind(request.path.c_str() + request.nameOffset) != ArchiveKind::none) {
+            result.archives.push_back(request.path);
+        }
+        keepFile(context, result, info.st_size, std::move(request.path));
+    };
+
+    for (auto& request : requests) {
+        const int fd = handles[request.dir]->fd;
+        const char* name = request.path.c_str() + request.nameOffset;
+        auto wanted = [&]() {
+            return matchesFilters(std::string_view(request.path).substr(0, request.nameOffset), name, options, context.rootLength);
+        };
+        struct stat info;
+
+        if (!request.typeKnown) {
+            auto start = context.throttle.beginStat();
+            int failed = fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW);
+            context.throttle.endStat(start);
+            if (failed) {
+                continue;
+            }
+            if (S_ISDIR(info.st_mode)) {
+                const PendingDir& dir = batch[request.dir];
+                if (options.depth == -1 || dir.depth < options.depth) {
+                    children.add(request.dir, {std::move(request.path), dir.depth + 1, handles[request.dir]});
+                }
+                continue;
+            }
+            if (S_ISREG(info.st_mode)) {
+                if (wanted()) {
+                    foundFile(request, info);
+                }
+                continue;
+            }
+            if (!S_ISLNK(info.st_mode) || (!options.followLinks && !wanted())) {
+                continue;
+            }
+        }
+
+        // Symbolic links count with the size of the regular file they point to,
+        // links to directories are followed if asked for
+        auto start = context.throttle.beginStat();
+        int failed = fstatat(fd, name, &info, 0);
+        context.throttle.endStat(start);
+        if (failed) {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode) && options.followLinks) {
+            const PendingDir& dir = batch[request.dir];
+            if (options.depth == -1 || dir.depth < options.depth) {
+                deferLink(context, {std::move(request.path), dir.depth + 1});
+            }
+        } else if (S_ISREG(info.st_mode) && wanted()) {
+            foundFile(request, info);
+        }
+    }
+    return entries;
+}
+#else
+/**
+ * @brief Scan a single directory: record matching files and queue its subdirectories.
+ *
+ * @return The number of entries read, as a measure of the work done.
+ */
+std::size_t scanDirectory(const PendingDir& dir, WalkContext& context, WalkResult& result, unsigned worker) {
+    const ToolOptions& options = context.options;
+    ChildDirs children(context.queue, 1, options.timeLimit > 0, worker);
+    std::error_code ec;
+    context.throttle.enterDirectory();
+    if (options.followLinks && !dir.claimed && !context.visited.insert(fs::canonical(dir.path, ec).string())) {
+        return 0; // Visited before, through a link or not
+    }
+    announceDirectory(context, dir);
+    fs::directory_iterator it(fs::path(dir.path), fs::directory_options::skip_permission_denied, ec);
+    if (ec) {
+        result.failedDirs++;
+    }
+    std::size_t entries = 0;
+
+    for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        std::error_code entryEc;
+        entries++;
+        if (!inShard(dir.depth, entry.path().filename().string(), options)) {
+            continue;
+        }
+
+        if (entry.is_directory(entryEc) && (options.followLinks || !entry.is_symlink(entryEc))) {
+            if (options.depth != -1 && dir.depth >= options.depth) {
+                continue;
+            }
+            if (entry.is_symlink(entryEc)) {
+                deferLink(context, {entry.path().string(), dir.depth + 1});
+            } else {
+                children.add(0, {entry.path().string(), dir.depth + 1});
+            }
+        } else if (entry.is_regular_file(entryEc) && matchesFilters(entry.path(), options, context.rootLength)) {
+            auto start = context.throttle.beginStat();
+            uintmax_t size = entry.file_size(entryEc);
+            context.throttle.endStat(start);
+            if (!entryEc) {
+                children.addBytes(0, size);
+                if (options.growInterval > 0 && entry.last_write_time(entryEc) >= context.recentSinceFileTime) {
+                    result.recent.push_back(entry.path().string());
+                }
+                if (options.archives && archiveKind(entry.path().filename().string()) != ArchiveKind::none) {
+                    result.archives.push_back(entry.path().string());
+                }
+                keepFile(context, result, size, entry.path().string());
+            }
+        }
+    }
+    return entries;
+}
+
+/**
+ * @brief Scan a batch of directories: record matching files and queue their subdirectories.
+ *
+ * @return The number of entries read, as a measure of the work done.
+ */
+std::size_t scanDirectories(const std::vector<PendingDir>& batch, WalkContext& context, WalkResult& result, unsigned worker) {
+    std::size_t entries = 0;
+    for (const auto& dir : batch) {
+        entries += scanDirectory(dir, context, result, worker);
+    }
+    return entries;
+}
+#endif
+
+/**
+ * @brief Pin a walker thread to its CPU, if the walkers are placed on NUMA nodes.
+ */
+void pinWalker(const WalkContext& context, unsigned worker) {
+#ifdef __linux__
+    // Linux places memory on the node of the thread that first touches it,
+    // so a pinned walker keeps the files it finds on its own node
+    if (!context.walkerCpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(context.walkerCpus[worker], &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+#else
+    (void)context;
+    (void)worker;
+#endif
+}
+
+/**
+ * @brief Walker thread: scan directories until the queue runs dry.
+ *
+ * For a top-N listing only the N largest files of each walker can make it into
+ * the result, so the rest is dropped early. With a spill area, files are
+ * spilled to sorted run files whenever the walker exceeds its share of the
+ * memory budget.
+ */
+void walk(WalkContext& context, WalkResult& result, unsigned worker) {
+    const ToolOptions& options = context.options;
+    DirQueue& queue = context.queue;
+    SpillArea* spillArea = context.spillArea;
+    const std::size_t batchSize = std::max(1, options.inodeBatch);
+    const std::size_t listLength = options.numFiles == -1 ? std::numeric_limits<std::size_t>::max() : options.numFiles;
+    std::vector<PendingDir> batch(1);
+    pinWalker(context, worker);
+
+    while (queue.pop(batch.front(), worker)) {
+        PendingDir dir;
+        while (batch.size() < batchSize && queue.tryPop(dir, worker)) {
+            batch.push_back(std::move(dir));
+        }
+        std::size_t entries = scanDirectories(batch, context, result, worker);
+        context.progress[worker].entries.fetch_add(entries, std::memory_order_relaxed);
+        context.progress[worker].dirs.fetch_add(batch.size(), std::memory_order_relaxed);
+        result.dirCount += batch.size();
+
+        // Keep only what can still make it into a top-N listing
+        if (options.typeMask != 0) {
+            if (result.paths.size() - result.typedPaths > (options.numFiles == -1 ? 0 : 2 * static_cast<std::size_t>(options.numFiles)) + 1024) {
+                keepLargestOfTypes(result, listLength, options.typeMask);
+            }
+        } else if (options.numFiles != -1 && result.files.size() > 2 * static_cast<std::size_t>(options.numFiles) + 1024) {
+            keepLargest(result, options.numFiles);
+        }
+
+        if (spillArea && result.bytes > context.memoryLimit) {
+            if (options.typeMask != 0) {
+                keepLargestOfTypes(result, listLength, options.typeMask);
+            }
+            spillRun(result, *spillArea);
+        }
+
+        // The result must not change after this, a checkpoint may read it as soon as the queue is idle
+        queue.done(static_cast<int>(batch.size()));
+        batch.resize(1);
+    }
+}
+
+/**
+ * @brief Leave behind a sorted run of the files a walker found.
+ *
+ * Runs only once no checkpoint can read the result anymore, on the CPU of the walker.
+ */
+void finishWalk(const WalkContext& context, WalkResult& result, unsigned worker) {
+    const ToolOptions& options = context.options;
+    pinWalker(context, worker);
+    if (options.typeMask != 0) {
+        keepLargestOfTypes(result, options.numFiles == -1 ? std::numeric_limits<std::size_t>::max() : options.numFiles, options.typeMask);
+    }
+    std::vector<FileRecord>& files = result.files;
+    if (!result.runs.empty()) {
+        spillRun(result, *context.spillArea);
+    } else if (options.numFiles == -1) {
+        sortForListing(files, result.paths);
+    } else if (files.size() > static_cast<std::size_t>(options.numFiles)) {
+        std::partial_sort(files.begin(), files.begin() + options.numFiles, files.end(), ListingOrder{&result.paths});
+        files.resize(options.numFiles);
+    } else {
+        std::sort(files.begin(), files.end(), ListingOrder{&result.paths});
+    }
+}
+
+/**
+ * @brief Merge two sorted ranges into out, splitting the work across several threads.
+ *
+ * The first range is cut into equal parts, and the matching split points of the
+ * second range are found by binary search, which yields independent merges.
+ * The records are compared in listing order, their paths taken from paths.
+ */
+void parallelMerge(const FileRecord* a, std::size_t aSize, const FileRecord* b, std::size_t bSize, FileRecord* out, unsigned parts,
+                   const std::vector<std::string>& paths) {
+    const ListingOrder order{&paths};
+    if (parts < 2 || aSize + bSize < 65536) {
+        std::merge(a, a + aSize, b, b + bSize, out, order);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    std::size_t aBegin = 0;
+    std::size_t bBegin = 0;
+    for (unsigned part = 1; part <= parts; ++part) {
+        std::size_t aEnd = part == parts ? aSize : aSize * part / parts;
+        std::size_t bEnd = part == parts ? bSize : std::lower_bound(b, b + bSize, a[aEnd], order) - b;
+        threads.emplace_back([=] {
+            std::merge(a + aBegin, a + aEnd, b + bBegin, b + bEnd, out + aBegin + bBegin, order);
+        });
+        aBegin = aEnd;
+        bBegin = bEnd;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * @brief Merge sorted runs that lie back to back in records.
+ *
+ * Runs are merged pairwise in rounds, so k runs take log2(k) rounds. Within a
+ * round the available threads are shared among the pairs, which keeps all cores
+ * busy even in the last round, where only one pair is left.
+ *
+ * @param records The records, holding the runs one after another.
+ * @param bounds The run boundaries, starting with 0 and ending with records.size().
+ * @param threads The number of threads to use.
+ * @param paths The paths the records refer to.
+ */
+void mergeRuns(std::vector<FileRecord>& records, std::vector<std::size_t> bounds, unsigned threads, const std::vector<std::string>& paths) {
+    std::vector<FileRecord> buffer(records.size());
+
+    while (bounds.size() > 2) {
+        std::size_t pairs = (bounds.size() - 1) / 2;
+        unsigned partsPerPair = std::max(1u, static_cast<unsigned>(threads / pairs));
+        std::vector<std::size_t> merged;
+        std::vector<std::thread> workers;
+
+        for (std::size_t run = 0; run + 1 < bounds.size(); run += 2) {
+            merged.push_back(bounds[run]);
+            if (run + 2 < bounds.size()) {
+                const FileRecord* first = records.data() + bounds[run];
+                const FileRecord* second = records.data() + bounds[run + 1];
+                FileRecord* out = buffer.data() + bounds[run];
+                std::size_t firstSize = bounds[run + 1] - bounds[run];
+                std::size_t secondSize = bounds[run + 2] - bounds[run + 1];
+                workers.emplace_back([=, &paths] {
+                    parallelMerge(first, firstSize, second, secondSize, out, partsPerPair, paths);
+                });
+            } else {
+                // Odd run out, carried over to the next round
+                std::copy(records.begin() + bounds[run], records.begin() + bounds[run + 1], buffer.begin() + bounds[run]);
+            }
+        }
+        merged.push_back(records.size());
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        records.swap(buffer);
+        bounds.swap(merged);
+    }
+}
+
+// Version 2 added the content types, link following and regular expression of the scan,
+// the links and directories visited while following links, the totals, and list files
+const char checkpointMagic[8] = {'L', 'G', 'S', 'T', 'C', 'K', 'P', '2'};
+
+/**
+ * @brief Write a string with its 32-bit length in binary form.
+ */
+void writeString(std::ostream& out, const std::string& value) {
+    uint32_t length = static_cast<uint32_t>(value.size());
+    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.write(value.data(), length);
+}
+
+/**
+ * @brief Read a string written by writeString().
+ */
+bool readString(std::istream& in, std::string& value) {
+    uint32_t length;
+    if (!in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+        return false;
+    }
+    value.resize(length);
+    return static_cast<bool>(in.read(&value[0], length));
+}
+
+/**
+ * @brief Write the identity of a directory to a binary stream.
+ */
+void writeDirKey(std::ostream& out, const DirKey& key) {
+#ifdef LARGEST_POSIX
+    uint64_t numbers[] = {key.first, key.second};
+    out.write(reinterpret_cast<const char*>(numbers), sizeof(numbers));
+#else
+    writeString(out, key);
+#endif
+}
+
+/**
+ * @brief Read the identity of a directory written by writeDirKey().
+ */
+bool readDirKey(std::istream& in, DirKey& key) {
+#ifdef LARGEST_POSIX
+    uint64_t numbers[2];
+    if (!in.read(reinterpret_cast<char*>(numbers), sizeof(numbers))) {
+        return false;
+    }
+    key = {numbers[0], numbers[1]};
+    return true;
+#else
+    return readString(in, key);
+#endif
+}
+
+fs::path checkpointList(const fs::path& checkpoint) {
+    fs::path list = checkpoint;
+    list += ".files";
+    return list;
+}
+
+/**
+ * @brief Append the files found since the last checkpoint of a full listing to its list file.
+ *
+ * Rewriting all files found so far at every checkpoint would take ever longer,
+ * so each checkpoint only appends to the list and records its new length. A
+ * write cut short leaves the records of the previous checkpoint intact, and
+ * what it left behind is cut off by the next one. A walk that has not taken
+ * over the list of the checkpoint it resumed from starts a new list, written
+ * to a temporary file first. The walkers are paused meanwhile: with --only,
+ * the files they have not classified yet are classified here, which keeps the
+ * files already in the list at the start of each walk result.
+ */
+void appendToList(WalkContext& context, std::vector<WalkResult>& results) {
+    const ToolOptions& options = context.options;
+    WalkContext::SavedList& list = context.savedList;
+    list.saved.resize(results.size(), 0);
+
+    const bool started = !list.file.empty();
+    const fs::path target = started ? list.file : checkpointList(options.checkpointFile);
+    fs::path file = target;
+    if (started) {
+        fs::resize_file(file, list.bytes);
+    } else {
+        file += ".tmp";
+    }
+    std::ofstream out(file, std::ios::binary | (started ? std::ios::app : std::ios::trunc));
+    uint64_t count = list.count;
+    uint64_t bytes = started ? list.bytes : 0;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        WalkResult& result = results[i];
+        if (options.typeMask != 0) {
+            keepLargestOfTypes(result, std::numeric_limits<std::size_t>::max(), options.typeMask);
+        }
+        for (std::size_t j = list.saved[i]; j < result.files.size(); ++j) {
+            const std::string& path = result.paths[result.files[j].index];
+            writeRecord(out, result.files[j].size, path);
+            bytes += sizeof(uint64_t) + sizeof(uint32_t) + path.size();
+        }
+        count += result.files.size() - list.saved[i];
+    }
+    if (!out.flush()) {
+        throw std::runtime_error("Failed to write checkpoint list " + file.string());
+    }
+    out.close();
+    if (!started) {
+        fs::rename(file, target);
+        list.file = target;
+    }
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        list.saved[i] = results[i].files.size();
+    }
+    list.count = count;
+    list.bytes = bytes;
+}
+
+/**
+ * @brief Select the files a checkpoint of a top-N listing keeps: the N largest of the types asked for.
+ *
+ * Files their walker has not classified yet are classified here, largest first
+ * and in batches, until enough files of the types asked for are found, just as
+ * keepLargestOfTypes() does.
+ */
+std::vector<std::pair<uintmax_t, const std::string*>> checkpointFiles(const ListOptions& options, const std::vector<WalkResult>& results) {
+    struct Candidate {
+        uintmax_t size;
+        const std::string* path;
+        bool typed; ///< Known to be of a type asked for
+    };
+    std::vector<Candidate> candidates;
+    for (const auto& result : results) {
+        for (const auto& record : result.files) {
+            candidates.push_back({record.size, &result.paths[record.index], options.typeMask == 0 || record.index < result.typedPaths});
+        }
+    }
+    const std::size_t n = static_cast<std::size_t>(options.numFiles);
+    auto larger = [](const Candidate& a, const Candidate& b) { return listedBefore(a.size, *a.path, b.size, *b.path); };
+
+    std::vector<std::pair<uintmax_t, const std::string*>> files;
+    if (options.typeMask == 0) {
+        if (candidates.size() > n) {
+            std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end(), larger);
+            candidates.resize(n);
+        }
+        for (const auto& candidate : candidates) {
+            files.emplace_back(candidate.size, candidate.path);
+        }
+        return files;
+    }
+
+    const std::size_t batchSize = 64;
+    std::sort(candidates.begin(), candidates.end(), larger);
+    for (std::size_t start = 0; start < candidates.size() && files.size() < n; start += batchSize) {
+        std::size_t end = std::min(candidates.size(), start + batchSize);
+        std::vector<const std::string*> unknown;
+        for (std::size_t i = start; i < end; ++i) {
+            if (!candidates[i].typed) {
+                unknown.push_back(candidates[i].path);
+            }
+        }
+        std::vector<FileType> types = classifyFiles(unknown);
+        for (std::size_t i = start, j = 0; i < end && files.size() < n; ++i) {
+            if (candidates[i].typed || (options.typeMask & (1u << static_cast<int>(types[j++])))) {
+                files.emplace_back(candidates[i].size, candidates[i].path);
+            }
+        }
+    }
+    return files;
+}
+
+/**
+ * @brief Save the progress of a paused scan.
+ *
+ * The checkpoint holds the options that determine the result, the pending
+ * directories, the links and directories visited so far when following links,
+ * the totals so far, and the files found so far: for a top-N listing the N
+ * largest of them, for a full listing the length of its list file. It is
+ * written to a temporary file first and then renamed, so an interruption
+ * while saving never destroys the previous checkpoint.
+ */
+void writeCheckpoint(WalkContext& context, const fs::path& root, const std::vector<PendingDir>& pending, std::vector<WalkResult>& results) {
+    const ToolOptions& options = context.options;
+    const fs::path& file = options.checkpointFile;
+    std::vector<std::pair<uintmax_t, const std::string*>> files;
+    if (options.numFiles == -1) {
+        appendToList(context, results);
+    } else {
+        files = checkpointFiles(options, results);
+    }
+    const std::vector<DirKey> visited = context.visited.keys();
+    uint64_t totals[4] = {};
+    for (const auto& result : results) {
+        totals[0] += result.fileCount;
+        totals[1] += result.totalBytes;
+        totals[2] += result.dirCount;
+        totals[3] += result.failedDirs;
+    }
+
+    fs::path temporary = file;
+    temporary += ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        int32_t depth = options.depth;
+        int32_t numFiles = options.numFiles;
+        uint32_t typeMask = options.typeMask;
+        uint8_t followLinks = options.followLinks;
+        uint64_t pendingCount = pending.size();
+        uint64_t linkCount = context.links.size();
+        uint64_t visitedCount = visited.size();
+        uint64_t fileCount = files.size();
+
+        out.write(checkpointMagic, sizeof(checkpointMagic));
+        writeString(out, root.string());
+        writeString(out, joinFileMasks(options.fileMasks()));
+        out.write(reinterpret_cast<const char*>(&depth), sizeof(depth));
+        out.write(reinterpret_cast<const char*>(&numFiles), sizeof(numFiles));
+        out.write(reinterpret_cast<const char*>(&typeMask), sizeof(typeMask));
+        out.write(reinterpret_cast<const char*>(&followLinks), sizeof(followLinks));
+        writeString(out, options.regexSource());
+        out.write(reinterpret_cast<const char*>(&pendingCount), sizeof(pendingCount));
+        for (const auto& dir : pending) {
+            int32_t dirDepth = dir.depth;
+            uint8_t claimed = dir.claimed;
+            writeRecord(out, dir.priority, dir.path);
+            out.write(reinterpret_cast<const char*>(&dirDepth), sizeof(dirDepth));
+            out.write(reinterpret_cast<const char*>(&claimed), sizeof(claimed));
+        }
+        out.write(reinterpret_cast<const char*>(&linkCount), sizeof(linkCount));
+        for (const auto& link : context.links) {
+            int32_t linkDepth = link.depth;
+            writeRecord(out, link.priority, link.path);
+            out.write(reinterpret_cast<const char*>(&linkDepth), sizeof(linkDepth));
+        }
+        out.write(reinterpret_cast<const char*>(&visitedCount), sizeof(visitedCount));
+        for (const auto& key : visited) {
+            writeDirKey(out, key);
+        }
+        out.write(reinterpret_cast<const char*>(totals), sizeof(totals));
+        out.write(reinterpret_cast<const char*>(&fileCount), sizeof(fileCount));
+        for (const auto& file : files) {
+            writeRecord(out, file.first, *file.second);
+        }
+        out.write(reinterpret_cast<const char*>(&context.savedList.count), sizeof(context.savedList.count));
+        out.write(reinterpret_cast<const char*>(&context.savedList.bytes), sizeof(context.savedList.bytes));
+        if (!out.flush()) {
+            throw std::runtime_error("Failed to write checkpoint " + temporary.string());
+        }
+    }
+    fs::rename(temporary, file);
+}
+
+Checkpoint readCheckpoint(const fs::path& file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(checkpointMagic)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic) - 1, checkpointMagic)
+        || (magic[sizeof(magic) - 1] != '1' && magic[sizeof(magic) - 1] != '2')) {
+        throw std::runtime_error("Not a largest checkpoint: " + file.string());
+    }
+    const bool hasFilters = magic[sizeof(magic) - 1] != '1';
+
+    Checkpoint checkpoint;
+    int32_t depth;
+    int32_t numFiles;
+    uint32_t typeMask = 0;
+    uint8_t followLinks = 0;
+    uint64_t pendingCount;
+    bool ok = readString(in, checkpoint.root) && readString(in, checkpoint.fileMask)
+           && in.read(reinterpret_cast<char*>(&depth), sizeof(depth))
+           && in.read(reinterpret_cast<char*>(&numFiles), sizeof(numFiles))
+           && (!hasFilters
+               || (in.read(reinterpret_cast<char*>(&typeMask), sizeof(typeMask))
+                   && in.read(reinterpret_cast<char*>(&followLinks), sizeof(followLinks)) && readString(in, checkpoint.regex)))
+           && in.read(reinterpret_cast<char*>(&pendingCount), sizeof(pendingCount));
+    checkpoint.depth = depth;
+    checkpoint.numFiles = numFiles;
+    checkpoint.typeMask = typeMask;
+    checkpoint.followLinks = followLinks != 0;
+
+    for (uint64_t i = 0; ok && i < pendingCount; ++i) {
+        PendingDir dir;
+        int32_t dirDepth;
+        uint8_t claimed = 0;
+        ok = readRecord(in, dir.priority, dir.path) && in.read(reinterpret_cast<char*>(&dirDepth), sizeof(dirDepth))
+          && (!hasFilters || in.read(reinterpret_cast<char*>(&claimed), sizeof(claimed)));
+        dir.depth = dirDepth;
+        dir.claimed = claimed != 0;
+        checkpoint.pending.push_back(std::move(dir));
+    }
+
+    uint64_t linkCount = 0;
+    ok = ok && (!hasFilters || in.read(reinterpret_cast<char*>(&linkCount), sizeof(linkCount)));
+    for (uint64_t i = 0; ok && i < linkCount; ++i) {
+        PendingDir link;
+        int32_t linkDepth;
+        ok = readRecord(in, link.priority, link.path) && in.read(reinterpret_cast<char*>(&linkDepth), sizeof(linkDepth));
+        link.depth = linkDepth;
+        checkpoint.links.push_back(std::move(link));
+    }
+
+    uint64_t visitedCount = 0;
+    ok = ok && (!hasFilters || in.read(reinterpret_cast<char*>(&visitedCount), sizeof(visitedCount)));
+    for (uint64_t i = 0; ok && i < visitedCount; ++i) {
+        DirKey key;
+        ok = readDirKey(in, key);
+        checkpoint.visited.push_back(std::move(key));
+    }
+
+    uint64_t totals[4] = {};
+    ok = ok && (!hasFilters || in.read(reinterpret_cast<char*>(totals), sizeof(totals)));
+    checkpoint.fileCount = totals[0];
+    checkpoint.totalBytes = totals[1];
+    checkpoint.dirCount = totals[2];
+    checkpoint.failedDirs = totals[3];
+
+    uint64_t fileCount = 0;
+    ok = ok && in.read(reinterpret_cast<char*>(&fileCount), sizeof(fileCount));
+    for (uint64_t i = 0; ok && i < fileCount; ++i) {
+        std::pair<uintmax_t, std::string> record;
+        ok = readRecord(in, record.first, record.second);
+        checkpoint.files.push_back(std::move(record));
+    }
+
+    ok = ok && (!hasFilters
+                || (in.read(reinterpret_cast<char*>(&checkpoint.listedFiles), sizeof(checkpoint.listedFiles))
+                    && in.read(reinterpret_cast<char*>(&checkpoint.listBytes), sizeof(checkpoint.listBytes))));
+    if (ok && checkpoint.listedFiles > 0) {
+        std::ifstream list(checkpointList(file), std::ios::binary);
+        for (uint64_t i = 0; ok && i < checkpoint.listedFiles; ++i) {
+            std::pair<uintmax_t, std::string> record;
+            ok = readRecord(list, record.first, record.second);
+            checkpoint.files.push_back(std::move(record));
+        }
+    }
+
+    if (!ok) {
+        throw std::runtime_error("Checkpoint is damaged: " + file.string());
+    }
+    return checkpoint;
+}
+
+// Version 2 added the content types, link following and regular expression of the scan
+const char partialMagic[8] = {'L', 'G', 'S', 'T', 'P', 'R', 'T', '2'};
+
+void writePartialHeader(std::ostream& out, const PartialResult& partial) {
+    int32_t numbers[] = {partial.depth, partial.numFiles, partial.shardIndex, partial.shardCount};
+    uint64_t totals[] = {partial.fileCount, partial.totalBytes, partial.dirCount};
+    uint32_t typeMask = partial.typeMask;
+    uint8_t followLinks = partial.followLinks;
+    out.write(partialMagic, sizeof(partialMagic));
+    writeString(out, partial.root);
+    writeString(out, partial.fileMask);
+    out.write(reinterpret_cast<const char*>(numbers), sizeof(numbers));
+    out.write(reinterpret_cast<const char*>(totals), sizeof(totals));
+    out.write(reinterpret_cast<const char*>(&typeMask), sizeof(typeMask));
+    out.write(reinterpret_cast<const char*>(&followLinks), sizeof(followLinks));
+    writeString(out, partial.regex);
+}
+
+PartialResult readPartialHeader(std::istream& in, const fs::path& file) {
+    char magic[sizeof(partialMagic)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic) - 1, partialMagic)
+        || (magic[sizeof(magic) - 1] != '1' && magic[sizeof(magic) - 1] != '2')) {
+        throw std::runtime_error("Not a largest partial result: " + file.string());
+    }
+    const bool hasFilters = magic[sizeof(magic) - 1] != '1';
+
+    PartialResult partial;
+    int32_t numbers[4];
+    uint64_t totals[3];
+    uint32_t typeMask = 0;
+    uint8_t followLinks = 0;
+    if (!readString(in, partial.root) || !readString(in, partial.fileMask)
+        || !in.read(reinterpret_cast<char*>(numbers), sizeof(numbers)) || !in.read(reinterpret_cast<char*>(totals), sizeof(totals))
+        || (hasFilters
+            && (!in.read(reinterpret_cast<char*>(&typeMask), sizeof(typeMask))
+                || !in.read(reinterpret_cast<char*>(&followLinks), sizeof(followLinks)) || !readString(in, partial.regex)))) {
+        throw std::runtime_error("Partial result is damaged: " + file.string());
+    }
+    partial.typeMask = typeMask;
+    partial.followLinks = followLinks != 0;
+    partial.depth = numbers[0];
+    partial.numFiles = numbers[1];
+    partial.shardIndex = numbers[2];
+    partial.shardCount = numbers[3];
+    partial.fileCount = totals[0];
+    partial.totalBytes = totals[1];
+    partial.dirCount = totals[2];
+    return partial;
+}
+
+/**
+ * @brief Periodically pause the walk and save a checkpoint, until the walk is finished.
+ */
+void saveCheckpoints(WalkContext& context, const fs::path& root, std::vector<WalkResult>& results, const std::atomic<bool>& stop) {
+    const auto interval = std::chrono::seconds(60);
+    auto last = std::chrono::steady_clock::now();
+
+    while (!stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (stop || std::chrono::steady_clock::now() - last < interval) {
+            continue;
+        }
+
+        context.queue.pause();
+        try {
+            std::lock_guard<std::mutex> lock(context.linksMutex);
+            writeCheckpoint(context, root, context.queue.pendingDirs(), results);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: " << e.what() << std::endl;
+        }
+        context.queue.resume();
+        last = std::chrono::steady_clock::now();
+    }
+}
+
+/**
+ * @brief Tune the number of active walker threads by hill climbing on the measured throughput.
+ *
+ * Every interval the throughput (entries read per second) is measured, and the
+ * active limit is moved a step further in the current direction. If the last
+ * step lowered the throughput, the direction is reversed. If throughput stays
+ * flat while the latency per call rises, the extra threads only queue up in the
+ * storage, so the number of threads is reduced. The latency is derived from the
+ * number of active threads and the throughput (Little's law), without timing
+ * every call.
+ *
+ * @param context The walk to tune.
+ * @param maxThreads The number of walker threads started.
+ * @param stop Set once the walk is finished.
+ */
+void tuneThreads(WalkContext& context, unsigned maxThreads, const std::atomic<bool>& stop) {
+    const auto interval = std::chrono::milliseconds(250);
+    unsigned limit = std::min(maxThreads, std::max(1u, std::thread::hardware_concurrency()));
+    int direction = 1;
+    double previousThroughput = 0;
+    double previousLatency = 0;
+    uint64_t previousEntries = 0;
+    context.queue.setActiveLimit(limit);
+
+    while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        while (!stop && std::chrono::steady_clock::now() - start < interval) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t entries = 0;
+        for (const auto& progress : context.progress) {
+            entries += progress.entries.load(std::memory_order_relaxed);
+        }
+        double throughput = (entries - previousEntries) / elapsed;
+        previousEntries = entries;
+        if (throughput == 0) {
+            continue; // Nothing finished, e.g. all threads are waiting on a slow network share
+        }
+        double latency = limit / throughput;
+
+        if (previousThroughput > 0) {
+            if (throughput < previousThroughput * 0.95) {
+                direction = -direction;
+            } else if (throughput < previousThroughput * 1.05 && latency > previousLatency * 1.2) {
+                direction = -1;
+            }
+        }
+        previousThroughput = throughput;
+        previousLatency = latency;
+
+        int step = std::max(1u, limit / 4);
+        limit = static_cast<unsigned>(std::clamp(static_cast<int>(limit) + direction * step, 1, static_cast<int>(maxThreads)));
+        context.queue.setActiveLimit(limit);
+    }
+}
+
+#ifdef __linux__
+/**
+ * @brief Parse a list of CPUs as found in sysfs, such as "0-3,8-11".
+ */
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first = 0;
+        int last = 0;
+        char dash = 0;
+        std::istringstream bounds(range);
+        if (!(bounds >> first)) {
+            continue;
+        }
+        if (!(bounds >> dash >> last) || dash != '-') {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * @brief Get the CPUs this process may run on, grouped by NUMA node.
+ *
+ * The nodes are read from /sys/devices/system/node. Without NUMA information,
+ * all CPUs form a single node. Nodes without CPUs available to the process,
+ * such as memory-only nodes, are left out.
+ */
+std::vector<std::vector<int>> cpusByNode() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+
+    std::map<int, std::vector<int>> nodes;
+    std::error_code ec;
+    for (fs::directory_iterator it("/sys/devices/system/node", ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        const std::string name = it->path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 || !std::all_of(name.begin() + 4, name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            continue;
+        }
+        std::ifstream in(it->path() / "cpulist");
+        std::string list;
+        std::getline(in, list);
+        for (int cpu : parseCpuList(list)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                nodes[std::stoi(name.substr(4))].push_back(cpu);
+            }
+        }
+    }
+
+    std::vector<std::vector<int>> result;
+    for (auto& node : nodes) {
+        result.push_back(std::move(node.second));
+    }
+    if (result.empty()) {
+        result.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                result.back().push_back(cpu);
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Pin the walkers to CPUs and assign them to the queues of their NUMA nodes.
+ *
+ * The walkers are dealt out to the nodes in turn, and within a node to its
+ * CPUs in turn, so that any number of active walkers is spread evenly.
+ */
+void placeWalkers(WalkContext& context, unsigned threadCount) {
+    std::vector<std::vector<int>> nodes = cpusByNode();
+    if (nodes.empty()) {
+        return;
+    }
+    std::vector<unsigned> walkerNodes;
+    for (unsigned i = 0; i < threadCount; ++i) {
+        const unsigned node = i % nodes.size();
+        walkerNodes.push_back(node);
+        context.walkerCpus.push_back(nodes[node][(i / nodes.size()) % nodes[node].size()]);
+    }
+    context.queue.setWalkerNodes(std::move(walkerNodes));
+}
+#endif
+
+unsigned walkerCount(const ListOptions& options) {
+    if (options.autoThreads) {
+        // Start plenty of walkers, the tuner decides how many of them are active
+        return std::clamp(4 * std::thread::hardware_concurrency(), 16u, 256u);
+    }
+    return options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<WalkResult> walkTree(const fs::path& root, const ToolOptions& options, SpillArea* spillArea, const Checkpoint* resumeFrom,
+                                 ScanTotals* totals, const FileSink* sink, const DirHook* dirHook) {
+    const fs::path path = trimRoot(root);
+    if (!resumeFrom) {
+        // A root that cannot be read is an error, not an empty tree
+        std::error_code ec;
+        fs::directory_iterator(path, ec);
+        if (ec) {
+            throw std::runtime_error("Cannot open directory " + path.string() + ": " + ec.message());
+        }
+    }
+    unsigned threadCount = walkerCount(options);
+
+    WalkContext context(options);
+    context.sink = sink;
+    context.dirHook = dirHook;
+    context.progress = std::vector<WalkContext::Progress>(threadCount);
+    context.rootLength = rootPrefixLength(path);
+    auto startTime = std::chrono::steady_clock::now();
+    if (options.timeLimit > 0) {
+        context.queue.setDeadline(startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.timeLimit)));
+    }
+#ifdef __linux__
+    if (options.numa) {
+        placeWalkers(context, threadCount);
+    }
+#endif
+    std::vector<WalkResult> results(threadCount);
+    if (resumeFrom) {
+        for (const auto& dir : resumeFrom->pending) {
+            context.queue.push(dir);
+        }
+        for (const auto& key : resumeFrom->visited) {
+            context.visited.insert(key);
+        }
+        context.links = resumeFrom->links;
+        for (const auto& file : resumeFrom->files) {
+            addFile(results[0], file.first, file.second);
+        }
+        // The files of the checkpoint are all of the types asked for
+        results[0].typedPaths = results[0].paths.size();
+        results[0].fileCount = resumeFrom->fileCount;
+        results[0].totalBytes = resumeFrom->totalBytes;
+        results[0].dirCount = resumeFrom->dirCount;
+        results[0].failedDirs = resumeFrom->failedDirs;
+        // Checkpoints saved to the same file go on appending to its list
+        if (resumeFrom->listedFiles > 0 && options.checkpointFile == options.resumeFile) {
+            context.savedList.file = checkpointList(options.checkpointFile);
+            context.savedList.saved = {resumeFrom->files.size()};
+            context.savedList.count = resumeFrom->listedFiles;
+            context.savedList.bytes = resumeFrom->listBytes;
+        }
+    } else {
+        context.queue.push({path.string(), 0});
+    }
+
+    if (spillArea) {
+        context.spillArea = spillArea;
+        context.memoryLimit = options.memoryLimit / threadCount;
+    }
+
+    std::atomic<bool> walkFinished{false};
+    std::thread tuner;
+    if (options.autoThreads) {
+        tuner = std::thread(tuneThreads, std::ref(context), threadCount, std::cref(walkFinished));
+    }
+    std::thread checkpointer;
+    if (!options.checkpointFile.empty()) {
+        checkpointer = std::thread(saveCheckpoints, std::ref(context), std::cref(path), std::ref(results), std::cref(walkFinished));
+    }
+
+    // With -L the walk runs in rounds, each following the links found in the one before
+    do {
+        std::vector<std::thread> walkers;
+        for (unsigned i = 0; i < threadCount; ++i) {
+            walkers.emplace_back(walk, std::ref(context), std::ref(results[i]), i);
+        }
+        for (auto& walker : walkers) {
+            walker.join();
+        }
+    } while (options.followLinks && !context.queue.isStopped() && followLinks(context));
+    walkFinished = true;
+    if (tuner.joinable()) {
+        tuner.join();
+    }
+    if (checkpointer.joinable()) {
+        checkpointer.join();
+    }
+
+    // A complete scan needs no checkpoint anymore, an interrupted one can be resumed from it
+    if (!options.checkpointFile.empty()) {
+        std::vector<PendingDir> pending = context.queue.pendingDirs();
+        if (pending.empty() && context.links.empty()) {
+            std::error_code ec;
+            fs::remove(options.checkpointFile, ec);
+            fs::remove(checkpointList(options.checkpointFile), ec);
+        } else {
+            writeCheckpoint(context, path, pending, results);
+        }
+    }
+
+    // The results are sorted only now that the checkpointer has stopped reading them
+    std::vector<std::thread> finishers;
+    for (unsigned i = 0; i < threadCount; ++i) {
+        finishers.emplace_back(finishWalk, std::cref(context), std::ref(results[i]), i);
+    }
+    for (auto& finisher : finishers) {
+        finisher.join();
+    }
+
+    if (totals) {
+        *totals = ScanTotals();
+        for (const auto& result : results) {
+            totals->fileCount += result.fileCount;
+            totals->totalBytes += result.totalBytes;
+            totals->dirCount += result.dirCount;
+            totals->failedDirs += result.failedDirs;
+        }
+        totals->pendingDirs = context.queue.size() + context.links.size();
+        totals->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    return results;
+}
+
+ScanTotals scanFiles(const fs::path& root, const ListOptions& options, const FileSink& sink) {
+    ToolOptions scanOptions(options);
+    scanOptions.numFiles = 0;
+    scanOptions.memoryLimit = 0;
+    ScanTotals totals;
+    walkTree(root, scanOptions, nullptr, nullptr, &totals, &sink);
+    return totals;
+}
+
+TopFiles::TopFiles(const fs::path& root, const ListOptions& options) : TopFiles(root, ToolOptions(options), nullptr) {}
+
+TopFiles::TopFiles(const fs::path& root, const ToolOptions& options, const Checkpoint* resumeFrom) : options(options) {
+    if (options.memoryLimit > 0) {
+        spillArea = std::make_unique<SpillArea>();
+    }
+    results = walkTree(root, options, spillArea.get(), resumeFrom, &scanTotals);
+}
+
+TopFiles::~TopFiles() = default;
+TopFiles::TopFiles(TopFiles&&) noexcept = default;
+TopFiles& TopFiles::operator=(TopFiles&&) noexcept = default;
+
+TopFiles scanTopFiles(const fs::path& root, const ToolOptions& options, const Checkpoint* resumeFrom) {
+    return TopFiles(root, options, resumeFrom);
+}
+
+void TopFiles::emit(const FileSink& sink) {
+    int count = 0;
+    auto limited = [&](uintmax_t size, const std::string& path) {
+        if (options.numFiles != -1 && count >= options.numFiles) {
+            return false;
+        }
+        count++;
+        return sink(size, path);
+    };
+
+    // Over the memory budget: spill what is left in memory and stream the merged runs
+    bool spilled = std::any_of(results.begin(), results.end(), [](const WalkResult& result) { return !result.runs.empty(); });
+    if (spilled) {
+        std::vector<fs::path> runs;
+        for (auto& result : results) {
+            if (!result.files.empty()) {
+                result.runs.push_back(spillArea->newRun());
+                writeRun(result.runs.back(), result);
+            }
+            runs.insert(runs.end(), result.runs.begin(), result.runs.end());
+            result = WalkResult();
+        }
+        if (options.numFiles != 0) {
+            mergeRunFiles(runs, *spillArea, limited);
+        }
+        return;
+    }
+
+    // Collect the runs back to back, renumbering their indices into a single list of paths
+    std::vector<std::string> paths;
+    std::vector<FileRecord> files;
+    std::vector<std::size_t> bounds = {0};
+    for (auto& result : results) {
+        std::size_t offset = paths.size();
+        for (const auto& file : result.files) {
+            files.push_back({file.size, offset + file.index});
+        }
+        std::move(result.paths.begin(), result.paths.end(), std::back_inserter(paths));
+        bounds.push_back(files.size());
+        result = WalkResult();
+    }
+    mergeRuns(files, bounds, walkerCount(options), paths);
+
+    for (const auto& file : files) {
+        if (!limited(file.size, paths[file.index])) {
+            break;
+        }
+    }
+}
+
+std::vector<std::pair<uintmax_t, std::string>> largestFiles(const fs::path& root, const ListOptions& options) {
+    std::vector<std::pair<uintmax_t, std::string>> files;
+    TopFiles(root, options).emit([&files](uintmax_t size, const std::string& path) {
+        files.emplace_back(size, path);
+        return true;
+    });
+    return files;
+}
+
+} // namespace largest
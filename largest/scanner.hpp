@@ -0,0 +1,455 @@
+/**
+ * @file scanner.hpp
+ * @brief The scanner behind largest: walk a directory tree in parallel, filter its files and rank them by size.
+ *
+ * The scanner can be embedded in other programs instead of running the largest
+ * tool. A scan is controlled by ListOptions. There are three ways to get at
+ * the files of a tree:
+ *
+ * - scanFiles() passes every matching file to a callback as soon as a walker
+ *   finds it, in no particular order, and stops when the callback says so.
+ * - TopFiles scans the tree on construction and then hands out the largest
+ *   files in order, merging on disk beyond the memory budget.
+ * - largestFiles() simply returns the largest files.
+ *
+ * All of them throw std::runtime_error if the root directory cannot be opened.
+ *
+ * @code
+ *     largest::ListOptions options;
+ *     largest::setFileMasks(options, {".log", ".gz"});
+ *     options.numFiles = 10;
+ *     for (const auto& [size, path] : largest::largestFiles("/var/log", options)) {
+ *         std::cout << size << " " << path << "\n";
+ *     }
+ * @endcode
+ *
+ * The building blocks below them, such as walkTree() and the run files, are
+ * declared in scanner_internal.hpp, for the other modes of the tool.
+ */
+#ifndef LARGEST_SCANNER_HPP
+#define LARGEST_SCANNER_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The lazy scan needs C++20 coroutines, it is left out of older builds
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LARGEST_COROUTINES 1
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace largest {
+
+namespace fs = std::filesystem;
+
+class PathRegex;
+class MaskMatcher;
+class SpillArea;
+struct WalkResult;
+struct Checkpoint;
+struct ToolOptions;
+
+/**
+ * @brief Options controlling the scan.
+ *
+ * The largest tool extends them with the options of its listing, see ToolOptions.
+ */
+struct ListOptions {
+    int depth = -1;             ///< Maximum depth of subdirectories, -1 for infinite depth
+    int numFiles = 50;          ///< Number of largest files to keep, -1 to keep all files
+    int threads = 0;            ///< Number of walker threads, 0 to use one per hardware thread
+    bool autoThreads = false;   ///< Tune the number of active walker threads while scanning
+    bool numa = false;          ///< Pin walker threads to CPUs spread over the NUMA nodes, with a queue per node (Linux only)
+    uintmax_t memoryLimit = 0;  ///< Memory budget in bytes for the files found, 0 for no limit
+    int inodeBatch = 0;         ///< Number of directories whose files are stat'ed together in inode order, 0 for readdir order
+    double maxStats = 0;        ///< Maximum number of stat calls per second, 0 for no limit
+    double maxDirs = 0;         ///< Maximum number of directories read per second, 0 for no limit
+    bool adaptive = false;      ///< Slow down when stat latency rises
+    double timeLimit = 0;       ///< Seconds after which the scan stops and lists what it found, 0 for no limit
+    int shardIndex = 0;         ///< Index of the part of the tree to scan, from 0 to shardCount - 1
+    int shardCount = 1;         ///< Number of parts the tree is split into, 1 to scan the whole tree
+    uint32_t typeMask = 0;      ///< Bit mask of the content types to list, 0 for all types
+    bool followLinks = false;   ///< Follow symbolic links to directories
+
+    /**
+     * @brief Get the file masks set by setFileMasks(), a file matching any of them is listed.
+     */
+    const std::vector<std::string>& fileMasks() const { return masks; }
+
+    /**
+     * @brief Get the regular expression set by setRegex(), empty if there is none.
+     */
+    const std::string& regexSource() const { return expression; }
+
+private:
+    // Kept private so that the masks and their matcher cannot get out of step
+    friend void setFileMasks(ListOptions& options, std::vector<std::string> masks);
+    friend void setRegex(ListOptions& options, const std::string& expression);
+    friend bool matchesMask(std::string_view fileName, const ListOptions& options);
+    friend bool matchesFilters(std::string_view directory, std::string_view name, const ListOptions& options, std::size_t rootLength);
+
+    std::vector<std::string> masks = {"*"};         ///< File masks to filter files by
+    std::shared_ptr<const MaskMatcher> maskMatcher; ///< Matcher for several file masks, if there are several
+    std::shared_ptr<const PathRegex> regex;         ///< Regular expression the relative paths of files must match, if any
+    std::string expression;                         ///< Source of the regular expression, for saving it
+};
+
+/**
+ * @brief Set the file masks to filter files by.
+ *
+ * A single mask is matched by a plain substring search, several masks at once
+ * by a MaskMatcher. If any mask matches all files, the others do not matter.
+ */
+void setFileMasks(ListOptions& options, std::vector<std::string> masks);
+
+/**
+ * @brief Set the regular expression the relative paths of files must match.
+ *
+ * The expression is compiled into a DFA, see PathRegex in scanner.cpp for the
+ * syntax. An empty expression matches all files.
+ */
+void setRegex(ListOptions& options, const std::string& expression);
+
+/**
+ * @brief Kinds of content, told apart by the magic numbers at the start of a file.
+ *
+ * VM images include other disk images, such as ISO images.
+ */
+enum class FileType : uint8_t { empty, text, video, audio, image, archive, compressed, database, vmImage, document, executable, data };
+
+const char* const fileTypeNames[] = {"empty", "text", "video", "audio", "image", "archive", "compressed", "database", "vm-image", "document", "executable", "data"};
+
+/**
+ * @brief Parse a comma separated list of type names into a bit mask of file types.
+ */
+uint32_t parseFileTypes(const std::string& list);
+
+/**
+ * @brief Totals of a scan over all walkers.
+ */
+struct ScanTotals {
+    uint64_t fileCount = 0;      ///< Number of matching files found, listed or not
+    uintmax_t totalBytes = 0;    ///< Total size of the matching files found
+    uint64_t dirCount = 0;       ///< Number of directories scanned
+    uint64_t failedDirs = 0;     ///< Number of directories that could not be opened
+    std::size_t pendingDirs = 0; ///< Number of directories left unscanned by the time limit
+    double seconds = 0;          ///< Duration of the scan
+};
+
+/**
+ * @brief Callback receiving files, by size and path; returning false asks for no more files.
+ */
+using FileSink = std::function<bool(uintmax_t size, const std::string& path)>;
+
+/**
+ * @brief Scan a directory tree, passing every matching file to a callback as soon as it is found.
+ *
+ * The files come in no particular order, from all walker threads, but the
+ * callback is called by one thread at a time. Once it returns false, no more
+ * directories are handed out and the scan ends as soon as the walkers have
+ * finished their current directories. Nothing is collected, so memory use
+ * does not grow with the size of the tree. The number of files and the
+ * memory budget are ignored.
+ *
+ * @param root The directory to scan.
+ * @param options The options controlling the scan.
+ * @param sink Called for every matching file.
+ * @return The totals of the scan. The files counted are exactly those passed to the callback:
+ *         of the types asked for, and none found after it returned false.
+ */
+ScanTotals scanFiles(const fs::path& root, const ListOptions& options, const FileSink& sink);
+
+/**
+ * @brief The largest files of a directory tree, in order of descending size.
+ *
+ * The tree is scanned on construction. Each walker sorts the files it found
+ * into a run, and the runs are then merged in parallel. If the files found
+ * exceed the memory budget, the runs are spilled to temporary files instead
+ * and merged while the files are handed out. It can be moved, taking the
+ * files and any spilled runs along, but not copied.
+ */
+class TopFiles {
+public:
+    /**
+     * @brief Scan a directory tree for its largest files.
+     *
+     * @param root The directory to scan.
+     * @param options The options controlling the scan; numFiles is the number of files kept.
+     */
+    TopFiles(const fs::path& root, const ListOptions& options);
+    ~TopFiles();
+    TopFiles(TopFiles&&) noexcept;
+    TopFiles& operator=(TopFiles&&) noexcept;
+
+    /**
+     * @brief Get the totals of the scan, including the files not kept.
+     */
+    const ScanTotals& totals() const { return scanTotals; }
+
+    /**
+     * @brief Pass the files found to a callback, largest first, until it returns false.
+     *
+     * The files are handed out only once, this releases them.
+     */
+    void emit(const FileSink& sink);
+
+private:
+    // The tool scans with its own options and checkpoints, through scanTopFiles() in scanner_internal.hpp
+    TopFiles(const fs::path& root, const ToolOptions& options, const Checkpoint* resumeFrom);
+    friend TopFiles scanTopFiles(const fs::path& root, const ToolOptions& options, const Checkpoint* resumeFrom);
+
+    ListOptions options;
+    std::unique_ptr<SpillArea> spillArea;
+    std::vector<WalkResult> results;
+    ScanTotals scanTotals;
+};
+
+/**
+ * @brief Get the largest files of a directory tree, in order of descending size.
+ *
+ * @param root The directory to scan.
+ * @param options The options controlling the scan; numFiles is the number of files returned, -1 for all.
+ */
+std::vector<std::pair<uintmax_t, std::string>> largestFiles(const fs::path& root, const ListOptions& options);
+
+#ifdef LARGEST_COROUTINES
+/**
+ * @brief Files handed from the walker threads to a consumer through a bounded buffer.
+ *
+ * While the buffer is full, the walkers wait, so a slow consumer slows the scan
+ * down instead of piling up files. The consumer is woken once half the buffer
+ * is filled, or after 10 ms, and takes all buffered files at once, so there is
+ * no switching between the threads for every file.
+ */
+class FileChannel {
+public:
+    explicit FileChannel(std::size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+    /**
+     * @brief Add a file, waiting while the buffer is full.
+     *
+     * @return false once the consumer has cancelled.
+     */
+    bool push(uintmax_t size, const std::string& path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return files.size() < capacity || cancelled; });
+        if (cancelled) {
+            return false;
+        }
+        files.emplace_back(size, path);
+        if (files.size() == (capacity + 1) / 2) {
+            notEmpty.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * @brief Mark the end of the files.
+     */
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        notEmpty.notify_one();
+    }
+
+    /**
+     * @brief Take all buffered files, waiting for some.
+     *
+     * @return false once all files have been taken.
+     */
+    bool pop(std::deque<std::pair<uintmax_t, std::string>>& batch) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // Wait for half a buffer, or for what has trickled in meanwhile on a slow scan
+            auto ready = [this] { return files.size() >= (capacity + 1) / 2 || finished; };
+            while (!notEmpty.wait_for(lock, std::chrono::milliseconds(10), ready) && files.empty()) {
+            }
+            if (files.empty()) {
+                return false;
+            }
+            batch.swap(files);
+        }
+        notFull.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief Take no more files, letting waiting walkers go.
+     */
+    void cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+        }
+        notFull.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<std::pair<uintmax_t, std::string>> files;
+    const std::size_t capacity;
+    bool finished = false;
+    bool cancelled = false;
+};
+
+/**
+ * @brief A sequence of files produced by a coroutine as it is iterated, once.
+ */
+class FileGenerator {
+public:
+    using value_type = std::pair<uintmax_t, std::string>;
+
+    struct promise_type {
+        const value_type* current = nullptr;
+        std::exception_ptr error;
+
+        FileGenerator get_return_object() { return FileGenerator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const value_type& file) noexcept {
+            current = &file;
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = FileGenerator::value_type;
+        using difference_type = std::ptrdiff_t;
+
+        explicit iterator(std::coroutine_handle<promise_type> handle = nullptr) : handle(handle) {}
+
+        const value_type& operator*() const { return *handle.promise().current; }
+        const value_type* operator->() const { return handle.promise().current; }
+
+        iterator& operator++() {
+            resume(handle);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const { return !handle || handle.done(); }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    FileGenerator(FileGenerator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    FileGenerator& operator=(FileGenerator&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~FileGenerator() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    /**
+     * @brief Start producing the files.
+     */
+    iterator begin() {
+        resume(handle);
+        return iterator(handle);
+    }
+
+    std::default_sentinel_t end() { return {}; }
+
+private:
+    explicit FileGenerator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    /**
+     * @brief Run the coroutine up to the next file, passing on an exception it ended with.
+     */
+    static void resume(std::coroutine_handle<promise_type> handle) {
+        handle.resume();
+        if (handle.done() && handle.promise().error) {
+            std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @brief Scan a directory tree lazily, yielding the matching files as the walkers find them.
+ *
+ * Nothing happens until the iteration starts. The files are then found by a
+ * scanFiles() running in the background, in no particular order. Once
+ * bufferSize files are waiting for the consumer, the walkers wait, so the scan
+ * goes no faster than the files are consumed. Ending the iteration early, for
+ * example with break, stops the scan: no further directories are read, and
+ * the walkers are joined when the generator is destroyed.
+ *
+ * @code
+ *     for (const auto& [size, path] : largest::scanLazily("/srv", options)) {
+ *         if (size > limit) {
+ *             break;
+ *         }
+ *     }
+ * @endcode
+ *
+ * @param root The directory to scan.
+ * @param options The options controlling the scan, see scanFiles().
+ * @param bufferSize The number of files found ahead of the consumer at most.
+ */
+inline FileGenerator scanLazily(fs::path root, ListOptions options, std::size_t bufferSize = 4096) {
+    FileChannel channel(bufferSize);
+    std::exception_ptr error;
+    std::thread scanner([&] {
+        try {
+            scanFiles(root, options, [&channel](uintmax_t size, const std::string& path) { return channel.push(size, path); });
+        } catch (...) {
+            error = std::current_exception();
+        }
+        channel.finish();
+    });
+
+    // Runs when the iteration ends, and also when the generator is destroyed while the scan is still running
+    struct Join {
+        FileChannel& channel;
+        std::thread& scanner;
+        ~Join() {
+            channel.cancel();
+            if (scanner.joinable()) {
+                scanner.join();
+            }
+        }
+    } join{channel, scanner};
+
+    std::deque<std::pair<uintmax_t, std::string>> batch;
+    while (channel.pop(batch)) {
+        for (const auto& file : batch) {
+            co_yield file;
+        }
+        batch.clear();
+    }
+    scanner.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+#endif
+} // namespace largest
+
+#endif // LARGEST_SCANNER_HPP
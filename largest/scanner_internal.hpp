@@ -0,0 +1,439 @@
+/**
+ * @file scanner_internal.hpp
+ * @brief The internals of the scanner that the modes of the largest tool are built from.
+ *
+ * Walk results, run files, checkpoints and partial results, and the options of
+ * the tool that go beyond a scan. Programs embedding the scanner only need
+ * scanner.hpp.
+ */
+#ifndef LARGEST_SCANNER_INTERNAL_HPP
+#define LARGEST_SCANNER_INTERNAL_HPP
+
+#include "scanner.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LARGEST_POSIX 1
+#endif
+
+namespace largest {
+
+/**
+ * @brief Options of the largest tool: those of the scan, and those of the listing and of the other modes.
+ */
+struct ToolOptions : ListOptions {
+    ToolOptions() = default;
+
+    /**
+     * @brief Take the scan options, leaving the listing and the other modes at their defaults.
+     */
+    explicit ToolOptions(const ListOptions& options) : ListOptions(options) {}
+
+    bool bare = false;          ///< Display only file paths without file sizes
+    bool relative = false;      ///< Display relative paths
+    int estimateProbes = 0;     ///< Number of random probes for estimating the tree instead of listing it, 0 to list
+    std::string checkpointFile; ///< File to save the progress of the scan to periodically, empty for none
+    std::string resumeFile;     ///< Checkpoint file to resume an interrupted scan from, empty to start afresh
+    double watchInterval = 0;   ///< Keep watching the tree, reprinting changes at most this often in seconds, 0 to list once
+    double growInterval = 0;    ///< List the fastest growing files, measured over this many seconds, 0 to list by size
+    std::string partialFile;    ///< File to save the result to for merging, instead of listing it, empty to list
+    bool archives = false;      ///< List the largest entries inside zip and tar archives instead of the largest files
+    bool extents = false;       ///< Report the extents of the files listed
+    bool compressibility = false; ///< Estimate how much compressing the files listed would save
+    bool showTypes = false;     ///< Show the content type of the files listed
+};
+
+/**
+ * @brief Join file masks into a single string, for saving them.
+ *
+ * A single mask is saved as it is, so checkpoints of scans with one mask stay readable by older versions.
+ */
+std::string joinFileMasks(const std::vector<std::string>& masks);
+
+/**
+ * @brief Split file masks joined by joinFileMasks().
+ */
+std::vector<std::string> splitFileMasks(const std::string& joined);
+
+/**
+ * @brief Get the length of the prefix that every path below a scan root starts with.
+ *
+ * Every file lies below the scan root, so its relative path is simply the part
+ * of its path following the root and a separator.
+ */
+std::size_t rootPrefixLength(const fs::path& root);
+
+/**
+ * @brief Check a file name against the file masks.
+ */
+bool matchesMask(std::string_view fileName, const ListOptions& options);
+
+/**
+ * @brief Check a file against the file mask and the regular expression.
+ *
+ * @param directory The path of the file's directory, ending with a separator.
+ * @param name The name of the file.
+ * @param rootLength The length of the scan root and its separator, see rootPrefixLength().
+ */
+bool matchesFilters(std::string_view directory, std::string_view name, const ListOptions& options, std::size_t rootLength);
+
+/**
+ * @brief Check a file given by its full path against the file mask and the regular expression.
+ */
+bool matchesFilters(const fs::path& path, const ListOptions& options, std::size_t rootLength);
+
+/**
+ * @brief Tell the types of a batch of files by reading their first bytes.
+ *
+ * All files are opened and their headers requested from the kernel first,
+ * without waiting for them. The kernel can then read the headers in parallel
+ * and in the order of the device, while they are read here one by one.
+ */
+std::vector<FileType> classifyFiles(const std::vector<const std::string*>& paths);
+
+/**
+ * @brief Kinds of archives whose entries can be listed.
+ */
+enum class ArchiveKind { none, zip, tar, tarGz };
+
+/**
+ * @brief Tell the kind of an archive from its file name.
+ */
+ArchiveKind archiveKind(std::string_view fileName);
+
+/**
+ * @brief A file found during the scan: its cached size and its index into the list of paths.
+ *
+ * Sorting these compact records instead of directory entries keeps the sort cache
+ * friendly and makes sure each file is only stat'ed once.
+ */
+struct FileRecord {
+    uintmax_t size;
+    std::size_t index;
+};
+
+/**
+ * @brief The order of every listing: by size, largest first, and equal sizes by path.
+ *
+ * This is a total order, so a listing does not depend on which walker found a
+ * file first, nor on how the tree was split into shards.
+ */
+inline bool listedBefore(uintmax_t aSize, const std::string& aPath, uintmax_t bSize, const std::string& bPath) {
+    return aSize > bSize || (aSize == bSize && aPath < bPath);
+}
+
+/**
+ * @brief Comparator ordering the records of a walk result as they are listed, see listedBefore().
+ *
+ * The paths are only compared for records of equal size.
+ */
+struct ListingOrder {
+    const std::vector<std::string>* paths;
+
+    bool operator()(const FileRecord& a, const FileRecord& b) const {
+        return listedBefore(a.size, (*paths)[a.index], b.size, (*paths)[b.index]);
+    }
+};
+
+/**
+ * @brief Sort records by size in descending order using an LSD radix sort.
+ *
+ * The 64-bit sizes are sorted one byte at a time, least significant byte first.
+ * Byte positions that are equal for all records (usually the high bytes, as few
+ * files are larger than a few GB) are skipped, so most listings need only three
+ * to five linear passes. The sort is stable.
+ */
+void radixSortBySize(std::vector<FileRecord>& records);
+
+/**
+ * @brief Sort records into listing order, see listedBefore().
+ *
+ * The records are radix sorted by size first. As the radix sort is stable,
+ * files of equal size are left in the order they were found in, so only
+ * these runs of equal sizes are then sorted by path, which costs little
+ * unless many files have the same size.
+ */
+void sortForListing(std::vector<FileRecord>& records, const std::vector<std::string>& paths);
+
+/**
+ * @brief The files found by one walker thread, kept on its own cache lines.
+ */
+struct alignas(64) WalkResult {
+    std::vector<std::string> paths;
+    std::vector<FileRecord> files;
+    std::size_t bytes = 0;        ///< Estimated memory held by paths and files
+    std::vector<fs::path> runs;   ///< Sorted runs spilled to disk
+    std::vector<std::string> recent; ///< Recently modified files, collected for monitoring growth
+    std::vector<std::string> archives; ///< Archives found, collected for inspecting their entries
+    uint64_t fileCount = 0;       ///< Number of matching files found, including those dropped or spilled
+    uintmax_t totalBytes = 0;     ///< Total size of the matching files found
+    uint64_t dirCount = 0;        ///< Number of directories scanned
+    uint64_t failedDirs = 0;      ///< Number of directories that could not be opened
+    std::size_t typedPaths = 0;   ///< Paths below this index are known to be of a type asked for
+};
+
+/**
+ * @brief Record a file found by a walker.
+ */
+void addFile(WalkResult& result, uintmax_t size, std::string path);
+
+/**
+ * @brief Drop all but the n largest files of a walk result.
+ */
+void keepLargest(WalkResult& result, std::size_t n);
+
+/**
+ * @brief Temporary directory holding the sorted runs spilled to disk.
+ *
+ * The directory is created on construction and removed, together with all
+ * runs in it, on destruction.
+ */
+class SpillArea {
+public:
+    SpillArea() {
+        std::random_device random;
+        directory = fs::temp_directory_path() / ("largest-" + std::to_string(random()));
+        fs::create_directories(directory);
+    }
+
+    ~SpillArea() {
+        std::error_code ec;
+        fs::remove_all(directory, ec);
+    }
+
+    /**
+     * @brief Get a new, unique file name for a run.
+     */
+    fs::path newRun() {
+        return directory / ("run" + std::to_string(nextRun++));
+    }
+
+private:
+    fs::path directory;
+    std::atomic<unsigned> nextRun{0};
+};
+
+/**
+ * @brief Write a file record in binary form.
+ *
+ * Each file is stored as its 64-bit size, the 32-bit length of its path and the
+ * path itself, which is much more compact than the in-memory representation.
+ */
+void writeRecord(std::ostream& out, uintmax_t size, const std::string& path);
+
+/**
+ * @brief Read a file record written by writeRecord().
+ *
+ * @return false at the end of the stream or on a read error.
+ */
+bool readRecord(std::istream& in, uintmax_t& size, std::string& path);
+
+/**
+ * @brief Sequential reader for a run file.
+ */
+class RunReader {
+public:
+    explicit RunReader(const fs::path& runFile) : in(runFile, std::ios::binary) {
+        if (!in) {
+            throw std::runtime_error("Failed to read temporary file " + runFile.string());
+        }
+        next();
+    }
+
+    /**
+     * @brief Read the records following the current position of an open stream.
+     */
+    explicit RunReader(std::ifstream&& stream) : in(std::move(stream)) {
+        next();
+    }
+
+    /**
+     * @brief Read the next file of the run.
+     *
+     * @return false at the end of the run.
+     */
+    bool next() {
+        valid = readRecord(in, size, path);
+        return valid;
+    }
+
+    bool valid = false;
+    uintmax_t size = 0;
+    std::string path;
+
+private:
+    std::ifstream in;
+};
+
+/**
+ * @brief Merge the files of sorted runs, passing them in order of descending size to a callback.
+ *
+ * @param readers The readers of the runs to merge.
+ * @param emit Called for every file; returning false ends the merge early.
+ */
+void mergeReaders(std::vector<std::unique_ptr<RunReader>>& readers, const FileSink& emit);
+
+/**
+ * @brief Merge sorted run files, passing the files in order of descending size to a callback.
+ *
+ * At most maxOpenRuns files are opened at a time. If there are more runs, groups of
+ * them are first merged into larger runs, so any number of runs can be merged.
+ *
+ * @param runs The run files to merge.
+ * @param spillArea The spill area to put intermediate runs into.
+ * @param emit Called for every file; returning false ends the merge early.
+ */
+void mergeRunFiles(std::vector<fs::path> runs, SpillArea& spillArea, const FileSink& emit);
+
+#ifdef LARGEST_POSIX
+/**
+ * @brief An open directory file descriptor, closed when the last user lets go of it.
+ */
+struct DirHandle {
+    explicit DirHandle(int fd) : fd(fd) {}
+    ~DirHandle();
+    DirHandle(const DirHandle&) = delete;
+    DirHandle& operator=(const DirHandle&) = delete;
+
+    int fd;
+};
+#endif
+
+/**
+ * @brief A directory waiting to be scanned.
+ */
+struct PendingDir {
+    std::string path;
+    int depth = 0;
+#ifdef LARGEST_POSIX
+    std::shared_ptr<DirHandle> parent = nullptr; ///< Open parent directory, the directory is opened relative to it if still open
+#endif
+    uintmax_t priority = 0;                      ///< Bytes found directly in the parent directory
+    bool claimed = false;                        ///< Reached through a link and already in the visited set, with -L
+};
+
+/**
+ * @brief Identity of a directory, to scan each directory once when following links.
+ *
+ * The device and inode on POSIX systems, the canonical path elsewhere.
+ */
+#ifdef LARGEST_POSIX
+using DirKey = std::pair<uint64_t, uint64_t>;
+#else
+using DirKey = std::string;
+#endif
+
+/**
+ * @brief Saved progress of a scan: the directories still to scan and the files found so far.
+ */
+struct Checkpoint {
+    std::string root;
+    std::string fileMask;
+    int depth = -1;
+    int numFiles = 50;
+    uint32_t typeMask = 0;
+    bool followLinks = false;
+    std::string regex;
+    std::vector<PendingDir> pending;
+    std::vector<DirKey> visited;    ///< Directories scanned so far, when following links
+    std::vector<PendingDir> links;  ///< Links to directories found but not followed yet, with -L
+    std::vector<std::pair<uintmax_t, std::string>> files;
+    uint64_t fileCount = 0;         ///< Totals of the scan so far
+    uintmax_t totalBytes = 0;
+    uint64_t dirCount = 0;
+    uint64_t failedDirs = 0;
+    uint64_t listedFiles = 0;       ///< Files of an unbounded listing in the list file, see checkpointList()
+    uint64_t listBytes = 0;         ///< Length of the list file these files take up
+};
+
+/**
+ * @brief Get the file an unbounded listing appends the files found to, next to its checkpoint.
+ */
+fs::path checkpointList(const fs::path& checkpoint);
+
+/**
+ * @brief Load a checkpoint written by writeCheckpoint().
+ */
+Checkpoint readCheckpoint(const fs::path& file);
+
+/**
+ * @brief Header of a partial result, the part of a listing saved by one shard of a scan.
+ *
+ * It is followed by the files of the shard in order of descending size, as
+ * written by writeRecord(), up to the end of the file.
+ */
+struct PartialResult {
+    std::string root;
+    std::string fileMask;
+    int depth = -1;
+    int numFiles = 50;
+    uint32_t typeMask = 0;
+    bool followLinks = false;
+    std::string regex;
+    int shardIndex = 0;
+    int shardCount = 1;
+    uint64_t fileCount = 0;  ///< Number of matching files in the shard, listed or not
+    uintmax_t totalBytes = 0;
+    uint64_t dirCount = 0;
+};
+
+/**
+ * @brief Write the header of a partial result.
+ */
+void writePartialHeader(std::ostream& out, const PartialResult& partial);
+
+/**
+ * @brief Read the header of a partial result written by writePartialHeader().
+ *
+ * The stream is left at the first file of the partial result.
+ */
+PartialResult readPartialHeader(std::istream& in, const fs::path& file);
+
+/// Files modified within this time before the scan count as recently modified
+constexpr std::chrono::seconds recentWindow{3600};
+
+/**
+ * @brief Callback told about a directory and its depth before a walker reads it.
+ */
+using DirHook = std::function<void(const std::string& path, int depth)>;
+
+/**
+ * @brief Get the number of walker threads to start.
+ */
+unsigned walkerCount(const ListOptions& options);
+
+/**
+ * @brief Scan a directory tree with several walker threads sharing a queue of directories.
+ *
+ * With a checkpoint file, the progress is saved periodically, and a scan can
+ * be continued from such a checkpoint.
+ *
+ * @param path The directory path to start the search.
+ * @param options The options controlling the scan.
+ * @param spillArea Where to spill runs beyond the memory budget, or nullptr to keep everything in memory.
+ * @param resumeFrom The checkpoint to continue from, or nullptr to start a new scan.
+ * @param totals Receives the totals of the scan, if not nullptr.
+ * @param sink Receives the files as they are found instead of the walk results, if not nullptr, see scanFiles().
+ * @param dirHook Called by the walkers with every directory they are about to read, one at a time, if not nullptr.
+ * @return The files found by each walker, sorted into a run.
+ * @throws std::runtime_error if a new scan cannot open its root directory.
+ */
+std::vector<WalkResult> walkTree(const fs::path& path, const ToolOptions& options, SpillArea* spillArea, const Checkpoint* resumeFrom,
+                                 ScanTotals* totals = nullptr, const FileSink* sink = nullptr, const DirHook* dirHook = nullptr);
+
+/**
+ * @brief Scan a directory tree for its largest files with the options of the tool.
+ *
+ * @param root The directory to scan.
+ * @param options The options controlling the scan.
+ * @param resumeFrom The checkpoint to continue from, or nullptr to start a new scan.
+ */
+TopFiles scanTopFiles(const fs::path& root, const ToolOptions& options, const Checkpoint* resumeFrom);
+
+} // namespace largest
+
+#endif // LARGEST_SCANNER_INTERNAL_HPP
@@ -0,0 +1,131 @@
+#!/bin/sh
+# Regression tests for largest: builds the tool and runs it on small trees made up on the spot.
+#
+# Usage: sh tests.sh [compiler flags...]
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+${CXX:-g++} -std=c++17 -O2 -pthread "$@" "$here/largest.cpp" "$here/scanner.cpp" -o "$work/largest" || exit 1
+largest="$work/largest"
+
+# Check that two outputs are the same: check name expected actual
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        printf 'expected:\n%s\nactual:\n%s\n' "$2" "$3"
+        failures=$((failures + 1))
+    fi
+}
+
+# A resumed --only scan lists the files of the types asked for, not the largest of any type.
+# The files lie in the root, which is read first, and the subdirectories keep the scan busy.
+mkdir -p "$work/types/b"
+for i in 1 2 3 4 5; do
+    head -c $((i * 400)) /dev/zero | tr '\0' 't' > "$work/types/text$i.txt"
+    head -c 1000000 /dev/zero > "$work/types/zero$i.bin"
+done
+i=0
+while [ $i -lt 2000 ]; do
+    mkdir -p "$work/types/b/d$i"
+    i=$((i + 1))
+done
+(
+    cd "$work/types" || exit 1
+    "$largest" -n 3 --only text -j 1 --time-limit 0.001 --checkpoint "$work/types.ckp" > /dev/null 2>&1
+    [ -f "$work/types.ckp" ] && "$largest" --resume "$work/types.ckp" 2> /dev/null
+) > "$work/resumed"
+(cd "$work/types" && "$largest" -n 3 --only text) > "$work/full"
+check "resume with --only" "$(cat "$work/full")" "$(cat "$work/resumed")"
+
+# Resumed scans go on counting where they stopped, and a full listing is appended to a list next to the checkpoint
+(
+    cd "$work/types" || exit 1
+    "$largest" -n -1 -j 1 --time-limit 0.001 --checkpoint "$work/full.ckp" > /dev/null 2>&1
+    while [ -f "$work/full.ckp" ]; do
+        "$largest" --resume "$work/full.ckp" -j 1 --time-limit 0.005 > "$work/resumed" 2> "$work/coverage"
+    done
+)
+(cd "$work/types" && "$largest" -n -1) > "$work/full"
+check "resume a full listing" "$(cat "$work/full")" "$(cat "$work/resumed")"
+check "resume totals" "Scanned 2002 directories" "$(grep -o 'Scanned [0-9]* directories' "$work/coverage")"
+
+# A resumed -L scan does not list again the files of directories it scanned before the checkpoint,
+# here a/target.bin through the link in the last subdirectory of b.
+mkdir -p "$work/links/a" "$work/links/b"
+head -c 5000 /dev/zero > "$work/links/a/target.bin"
+i=0
+while [ $i -lt 3000 ]; do
+    mkdir "$work/links/b/d$i"
+    i=$((i + 1))
+done
+ln -s ../../a "$work/links/b/d2999/l2"
+(
+    cd "$work/links" || exit 1
+    "$largest" -L -j 1 --time-limit 0.01 --checkpoint "$work/links.ckp" > /dev/null 2>&1
+    [ -f "$work/links.ckp" ] && "$largest" --resume "$work/links.ckp" 2> /dev/null
+) > "$work/resumed"
+check "resume with -L" "1" "$(grep -c target.bin "$work/resumed")"
+
+# --regex matches like grep -E, with anchors in any branch
+mkdir -p "$work/regex/d" "$work/regex/e"
+for f in d/x.log d/b e/big.txt e/ab e/a.txt; do
+    echo hello > "$work/regex/$f"
+done
+for expression in '^d|txt' 'a|b$' 'x\.log$|big' '(^e|^s)/.$' '\.(txt)?$|^d'; do
+    check "--regex '$expression'" \
+        "$(cd "$work/regex" && find . -type f | sed 's|^\./||' | grep -E -- "$expression" | sort)" \
+        "$(cd "$work/regex" && "$largest" -n -1 -b -r --regex "$expression" | sort)"
+done
+
+# Nested counted repetitions are refused before they are expanded, instead of running for minutes
+check "--regex nested repetitions" "Error: Regular expression is too large" \
+    "$(cd "$work/regex" && "$largest" --regex '((a{1000}){1000}){50}' 2>&1)"
+
+# --only holds for the files --watch and --estimate read on their own, too
+mkdir -p "$work/modes"
+for i in 1 2; do
+    head -c $((i * 3000)) /dev/zero | tr '\0' 't' > "$work/modes/text$i.txt"
+done
+head -c 50000 /dev/zero > "$work/modes/zero1.bin"
+check "--estimate --only" "  Files      : 2 +/- 0" \
+    "$(cd "$work/modes" && "$largest" --estimate 10 --only text | grep Files)"
+if [ "$(uname)" = Linux ]; then
+    (cd "$work/modes" && exec "$largest" --watch 0.2 --only text -b -r) > "$work/watched" 2>&1 &
+    watcher=$!
+    sleep 1
+    head -c 50000 /dev/zero > "$work/modes/zero2.bin"
+    head -c 9000 /dev/zero | tr '\0' 't' > "$work/modes/text3.txt"
+    sleep 1
+    kill $watcher
+    wait $watcher 2> /dev/null
+    check "--watch --only" "$(printf 'text3.txt\ntext2.txt\ntext1.txt')" "$(grep -v -e --- -e '^$' "$work/watched" | tail -3)"
+fi
+
+# Under -L every directory is listed under the same path, whichever walker reaches it first
+mkdir -p "$work/linked/real"
+i=0
+while [ $i -lt 50 ]; do
+    mkdir "$work/linked/real/s$i"
+    head -c $((i + 1)) /dev/zero > "$work/linked/real/s$i/f"
+    i=$((i + 1))
+done
+for j in 0 1 2 3 4 5 6 7; do
+    mkdir "$work/linked/l$j"
+    ln -s ../real "$work/linked/l$j/all"
+    ln -s ../real/s$j "$work/linked/l$j/one"
+done
+first=$(cd "$work/linked" && "$largest" -L -j 16 -n -1 -b -r)
+for run in 1 2 3 4 5 6 7 8 9 10; do
+    output=$(cd "$work/linked" && "$largest" -L -j 16 -n -1 -b -r)
+    [ "$output" = "$first" ] || break
+done
+check "-L paths" "$first" "$output"
+check "-L paths without links" "0" "$(printf '%s\n' "$first" | grep -c '^l')"
+
+exit $((failures > 0))